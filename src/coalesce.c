@@ -0,0 +1,251 @@
+/*
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2020, CESAR. All rights reserved.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+/**
+ * Outbound data coalescing source file
+ *
+ * Samples published for the same device are buffered during a time window
+ * and sent together as a single data message.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <errno.h>
+#include <ell/ell.h>
+
+#include <knot/knot_protocol.h>
+
+#include "knot_cloud.h"
+#include "coalesce.h"
+
+struct coalesce_device {
+	char *id;
+	struct knot_cloud_sample *samples;
+	size_t len;
+};
+
+struct coalesce_context {
+	struct l_hashmap *devices;
+	struct l_timeout *window_timeout;
+	uint32_t window_ms;
+	size_t max_samples;
+	coalesce_flush_cb_t flush_cb;
+};
+
+static struct coalesce_context coalesce_ctx;
+
+static void coalesce_device_free(void *data)
+{
+	struct coalesce_device *device = data;
+
+	if (device->len)
+		l_error("Dropped %zu samples of %s", device->len, device->id);
+
+	l_free(device->samples);
+	l_free(device->id);
+	l_free(device);
+}
+
+/*
+ * Samples the cloud can't take yet are kept and sent with the next window,
+ * the ones that fail otherwise are dropped.
+ */
+static int flush_device(struct coalesce_device *device)
+{
+	int err;
+
+	if (!device->len)
+		return 0;
+
+	err = coalesce_ctx.flush_cb(device->id, device->samples, device->len);
+	if (err == -EAGAIN)
+		return err;
+
+	if (err < 0)
+		l_error("Failed to send %zu samples of %s", device->len,
+			device->id);
+
+	device->len = 0;
+
+	return err;
+}
+
+static void has_samples(const void *key, void *value, void *user_data)
+{
+	const struct coalesce_device *device = value;
+	bool *pending = user_data;
+
+	if (device->len)
+		*pending = true;
+}
+
+static bool flush_device_or_remove(const void *key, void *value,
+				   void *user_data)
+{
+	struct coalesce_device *device = value;
+
+	/* Drop devices that have been idle for a whole window */
+	if (!device->len) {
+		coalesce_device_free(device);
+		return true;
+	}
+
+	flush_device(device);
+
+	return false;
+}
+
+static void on_window_timeout(struct l_timeout *timeout, void *user_data)
+{
+	bool pending = false;
+
+	coalesce_flush();
+
+	/* Samples held back by the cloud are tried again the next window */
+	l_hashmap_foreach(coalesce_ctx.devices, has_samples, &pending);
+	if (pending) {
+		l_timeout_modify_ms(timeout, coalesce_ctx.window_ms);
+		return;
+	}
+
+	l_timeout_remove(coalesce_ctx.window_timeout);
+	coalesce_ctx.window_timeout = NULL;
+}
+
+static void arm_window(void)
+{
+	if (!coalesce_ctx.window_timeout)
+		coalesce_ctx.window_timeout = l_timeout_create_ms(
+						coalesce_ctx.window_ms,
+						on_window_timeout, NULL, NULL);
+}
+
+/**
+ * coalesce_push:
+ * @id: device id
+ * @sample: sensor reading to be buffered
+ *
+ * Buffers @sample until the current window expires or the device buffer is
+ * full, whichever comes first. Samples the cloud can't take yet stay in the
+ * buffer, and a sample finding the buffer still full is refused.
+ *
+ * Returns: 0 if successful, -EAGAIN if the device buffer is full and the
+ * cloud can't take it yet, or a negative errno otherwise.
+ */
+int coalesce_push(const char *id, const struct knot_cloud_sample *sample)
+{
+	struct coalesce_device *device;
+
+	if (!coalesce_ctx.devices)
+		return -ENOTCONN;
+
+	device = l_hashmap_lookup(coalesce_ctx.devices, id);
+	if (!device) {
+		device = l_new(struct coalesce_device, 1);
+		device->id = l_strdup(id);
+		device->samples = l_new(struct knot_cloud_sample,
+					coalesce_ctx.max_samples);
+		l_hashmap_insert(coalesce_ctx.devices, device->id, device);
+	}
+
+	if (device->len == coalesce_ctx.max_samples &&
+	    flush_device(device) == -EAGAIN)
+		return -EAGAIN;
+
+	device->samples[device->len++] = *sample;
+
+	if (device->len == coalesce_ctx.max_samples)
+		flush_device(device);
+
+	if (device->len)
+		arm_window();
+
+	return 0;
+}
+
+bool coalesce_is_enabled(void)
+{
+	return coalesce_ctx.devices != NULL;
+}
+
+/**
+ * coalesce_flush:
+ *
+ * Sends all buffered samples, one message per device.
+ */
+void coalesce_flush(void)
+{
+	if (!coalesce_ctx.devices)
+		return;
+
+	l_hashmap_foreach_remove(coalesce_ctx.devices, flush_device_or_remove,
+				 NULL);
+}
+
+/**
+ * coalesce_start:
+ * @window_ms: time in milliseconds samples are held before being sent
+ * @max_samples: number of samples of a device that triggers an early flush
+ * @flush_cb: callback to send the samples of a device
+ *
+ * Starts buffering samples pushed with coalesce_push().
+ *
+ * Returns: 0 if successful and a negative errno otherwise.
+ */
+int coalesce_start(uint32_t window_ms, size_t max_samples,
+		   coalesce_flush_cb_t flush_cb)
+{
+	if (!window_ms || !max_samples || !flush_cb)
+		return -EINVAL;
+
+	if (coalesce_ctx.devices)
+		return -EALREADY;
+
+	coalesce_ctx.devices = l_hashmap_string_new();
+	coalesce_ctx.window_ms = window_ms;
+	coalesce_ctx.max_samples = max_samples;
+	coalesce_ctx.flush_cb = flush_cb;
+
+	return 0;
+}
+
+/**
+ * coalesce_stop:
+ *
+ * Sends any buffered samples and stops coalescing.
+ */
+void coalesce_stop(void)
+{
+	if (!coalesce_ctx.devices)
+		return;
+
+	l_timeout_remove(coalesce_ctx.window_timeout);
+	coalesce_ctx.window_timeout = NULL;
+
+	coalesce_flush();
+
+	l_hashmap_destroy(coalesce_ctx.devices, coalesce_device_free);
+	coalesce_ctx.devices = NULL;
+}
@@ -0,0 +1,37 @@
+/*
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2020, CESAR. All rights reserved.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+/**
+ * Outbound data coalescing header file
+ */
+
+struct knot_cloud_sample;
+
+typedef int (*coalesce_flush_cb_t) (const char *id,
+				    const struct knot_cloud_sample *samples,
+				    size_t num_samples);
+
+int coalesce_push(const char *id, const struct knot_cloud_sample *sample);
+bool coalesce_is_enabled(void);
+void coalesce_flush(void);
+int coalesce_start(uint32_t window_ms, size_t max_samples,
+		   coalesce_flush_cb_t flush_cb);
+void coalesce_stop(void);
@@ -0,0 +1,140 @@
+/*
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2020, CESAR. All rights reserved.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+
+/**
+ * Message body compression source file
+ *
+ * Bodies are compressed in the zlib format, labeled as the deflate
+ * content encoding.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <errno.h>
+#include <zlib.h>
+#include <ell/ell.h>
+
+#include "compress.h"
+
+/**
+ * compress_deflate:
+ * @data: body to be compressed
+ * @len: length of @data
+ * @out: filled with the compressed body, to be freed with l_free()
+ * @out_len: filled with the length of @out
+ *
+ * Returns: 0 if successful, -ENOSPC if compressing doesn't make @data any
+ * smaller and a negative errno otherwise.
+ */
+int compress_deflate(const void *data, size_t len, uint8_t **out,
+		     size_t *out_len)
+{
+	uLongf dest_len = compressBound(len);
+	uint8_t *dest;
+	int err;
+
+	dest = l_malloc(dest_len);
+
+	err = compress2(dest, &dest_len, data, len, Z_BEST_SPEED);
+	if (err != Z_OK) {
+		l_free(dest);
+		return err == Z_MEM_ERROR ? -ENOMEM : -EINVAL;
+	}
+
+	if (dest_len >= len) {
+		l_free(dest);
+		return -ENOSPC;
+	}
+
+	*out = dest;
+	*out_len = dest_len;
+
+	return 0;
+}
+
+/**
+ * compress_inflate:
+ * @data: compressed body
+ * @len: length of @data
+ * @max_len: largest body accepted once decompressed
+ * @out: filled with the body followed by a NUL byte not counted in
+ * @out_len, to be freed with l_free()
+ * @out_len: filled with the length of @out
+ *
+ * Returns: 0 if successful, -EMSGSIZE if the body is larger than @max_len
+ * and a negative errno otherwise.
+ */
+int compress_inflate(const void *data, size_t len, size_t max_len,
+		     char **out, size_t *out_len)
+{
+	z_stream stream = {
+		.next_in = (Bytef *) data,
+		.avail_in = len
+	};
+	size_t size = len * 4 + 1;
+	uint8_t *dest;
+	int err;
+
+	if (inflateInit(&stream) != Z_OK)
+		return -ENOMEM;
+
+	dest = l_malloc(size);
+
+	do {
+		/* Keep the last byte for the terminator */
+		if (stream.total_out + 1 >= size) {
+			if (size > max_len)
+				break;
+
+			size *= 2;
+			dest = l_realloc(dest, size);
+		}
+
+		stream.next_out = dest + stream.total_out;
+		stream.avail_out = size - stream.total_out - 1;
+
+		err = inflate(&stream, Z_NO_FLUSH);
+	} while (err == Z_OK);
+
+	inflateEnd(&stream);
+
+	if (stream.total_out > max_len || err == Z_OK) {
+		l_free(dest);
+		return -EMSGSIZE;
+	}
+
+	if (err != Z_STREAM_END) {
+		l_free(dest);
+		return -EBADMSG;
+	}
+
+	dest[stream.total_out] = '\0';
+
+	*out = (char *) dest;
+	*out_len = stream.total_out;
+
+	return 0;
+}
@@ -0,0 +1,313 @@
+/*
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2020, CESAR. All rights reserved.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+
+/**
+ * Outbound data event filter source file
+ *
+ * Keeps the last reading sent for each sensor and drops the readings that
+ * don't trigger any of the events set in the sensor config: a change of
+ * value, a value out of the thresholds or the end of the time period.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <ell/ell.h>
+
+#include <knot/knot_protocol.h>
+
+#include "knot_cloud.h"
+#include "event.h"
+#include "util.h"
+
+struct event_sensor {
+	uint8_t sensor_id;
+	uint8_t value_type;
+	knot_event event;
+	bool sent;
+	knot_value_type last_value;
+	uint8_t last_len;
+	uint64_t last_time;
+};
+
+struct event_context {
+	struct l_hashmap *devices;
+};
+
+static struct event_context event_ctx;
+
+static void event_device_free(void *data)
+{
+	l_queue_destroy(data, l_free);
+}
+
+static bool sensor_id_cmp(const void *a, const void *b)
+{
+	const struct event_sensor *sensor = a;
+	uint8_t sensor_id = L_PTR_TO_UINT(b);
+
+	return sensor->sensor_id == sensor_id;
+}
+
+static void add_sensor(void *data, void *user_data)
+{
+	knot_msg_config *config = data;
+	struct l_queue *sensors = user_data;
+	struct event_sensor *sensor;
+
+	/* Sensors whose event was rejected by the cloud aren't filtered */
+	if (config->event.event_flags & KNOT_EVT_FLAG_UNREGISTERED)
+		return;
+
+	sensor = l_new(struct event_sensor, 1);
+	sensor->sensor_id = config->sensor_id;
+	sensor->value_type = config->schema.value_type;
+	sensor->event = config->event;
+
+	l_queue_push_tail(sensors, sensor);
+}
+
+static int compare_value(uint8_t value_type, const knot_value_type *a,
+			 const knot_value_type *b)
+{
+	switch (value_type) {
+	case KNOT_VALUE_TYPE_INT:
+		return (a->val_i > b->val_i) - (a->val_i < b->val_i);
+	case KNOT_VALUE_TYPE_FLOAT:
+		return (a->val_f > b->val_f) - (a->val_f < b->val_f);
+	case KNOT_VALUE_TYPE_INT64:
+		return (a->val_i64 > b->val_i64) - (a->val_i64 < b->val_i64);
+	case KNOT_VALUE_TYPE_UINT:
+		return (a->val_u > b->val_u) - (a->val_u < b->val_u);
+	case KNOT_VALUE_TYPE_UINT64:
+		return (a->val_u64 > b->val_u64) - (a->val_u64 < b->val_u64);
+	default:
+		return 0;
+	}
+}
+
+/* Only the bytes that fit the value are sent, whatever the length says */
+static uint8_t raw_len(const struct knot_cloud_sample *sample)
+{
+	return MIN(sample->kval_len, KNOT_DATA_RAW_SIZE);
+}
+
+static bool has_changed(const struct event_sensor *sensor,
+			const struct knot_cloud_sample *sample)
+{
+	switch (sample->value_type) {
+	case KNOT_VALUE_TYPE_BOOL:
+		return sample->value.val_b != sensor->last_value.val_b;
+	case KNOT_VALUE_TYPE_RAW:
+		return raw_len(sample) != sensor->last_len ||
+			memcmp(sample->value.raw, sensor->last_value.raw,
+			       raw_len(sample));
+	default:
+		return compare_value(sample->value_type, &sample->value,
+				     &sensor->last_value) != 0;
+	}
+}
+
+static bool is_event(const struct event_sensor *sensor,
+		     const struct knot_cloud_sample *sample, uint64_t now)
+{
+	uint8_t flags = sensor->event.event_flags;
+	knot_value_type limit;
+
+	/* Nothing to compare the first reading and a new type with */
+	if (!sensor->sent || sample->value_type != sensor->value_type)
+		return true;
+
+	if ((flags & KNOT_EVT_FLAG_CHANGE) && has_changed(sensor, sample))
+		return true;
+
+	if ((flags & KNOT_EVT_FLAG_TIME) &&
+	    l_time_diff(sensor->last_time, now) >=
+			(uint64_t) sensor->event.time_sec * L_USEC_PER_SEC)
+		return true;
+
+	if (flags & KNOT_EVT_FLAG_LOWER_THRESHOLD) {
+		limit = sensor->event.lower_limit;
+		if (compare_value(sample->value_type, &sample->value,
+				  &limit) < 0)
+			return true;
+	}
+
+	if (flags & KNOT_EVT_FLAG_UPPER_THRESHOLD) {
+		limit = sensor->event.upper_limit;
+		if (compare_value(sample->value_type, &sample->value,
+				  &limit) > 0)
+			return true;
+	}
+
+	return false;
+}
+
+/**
+ * event_set_config:
+ * @id: device id
+ * @config_list: list of knot_msg_config of the device sensors
+ *
+ * Replaces the config the readings of @id are filtered with. Readings of
+ * sensors missing from @config_list are always sent.
+ *
+ * Returns: 0 if successful and a negative errno otherwise.
+ */
+int event_set_config(const char *id, struct l_queue *config_list)
+{
+	struct l_queue *sensors;
+	void *old_sensors;
+
+	if (!event_ctx.devices)
+		return -ENOTCONN;
+
+	if (!id || !config_list)
+		return -EINVAL;
+
+	sensors = l_queue_new();
+	l_queue_foreach(config_list, add_sensor, sensors);
+
+	l_hashmap_replace(event_ctx.devices, id, sensors, &old_sensors);
+	event_device_free(old_sensors);
+
+	return 0;
+}
+
+/**
+ * event_remove_device:
+ * @id: device id
+ *
+ * Stops filtering the readings of @id.
+ */
+void event_remove_device(const char *id)
+{
+	if (!event_ctx.devices)
+		return;
+
+	event_device_free(l_hashmap_remove(event_ctx.devices, id));
+}
+
+static struct event_sensor *find_sensor(const char *id,
+				       const struct knot_cloud_sample *sample)
+{
+	struct l_queue *sensors;
+	struct event_sensor *sensor;
+
+	if (!event_ctx.devices)
+		return NULL;
+
+	sensors = l_hashmap_lookup(event_ctx.devices, id);
+	if (!sensors)
+		return NULL;
+
+	sensor = l_queue_find(sensors, sensor_id_cmp,
+			      L_UINT_TO_PTR(sample->sensor_id));
+	if (!sensor || !sensor->event.event_flags)
+		return NULL;
+
+	return sensor;
+}
+
+/**
+ * event_filter:
+ * @id: device id
+ * @sample: sensor reading about to be sent
+ *
+ * Checks @sample against the config of its sensor and the last reading
+ * recorded with event_commit(). Nothing is recorded, so a reading that
+ * fails to be sent is checked again the next time.
+ *
+ * Returns: true if @sample must be sent and false if it can be dropped.
+ */
+bool event_filter(const char *id, const struct knot_cloud_sample *sample)
+{
+	struct event_sensor *sensor = find_sensor(id, sample);
+
+	if (!sensor)
+		return true;
+
+	return is_event(sensor, sample, l_time_now());
+}
+
+/**
+ * event_commit:
+ * @id: device id
+ * @sample: sensor reading that was sent
+ *
+ * Records @sample as the last reading sent by its sensor, which the next
+ * readings are filtered against.
+ */
+void event_commit(const char *id, const struct knot_cloud_sample *sample)
+{
+	struct event_sensor *sensor = find_sensor(id, sample);
+
+	if (!sensor)
+		return;
+
+	sensor->sent = true;
+	sensor->value_type = sample->value_type;
+	sensor->last_value = sample->value;
+	sensor->last_len = raw_len(sample);
+	sensor->last_time = l_time_now();
+}
+
+bool event_is_enabled(void)
+{
+	return event_ctx.devices != NULL;
+}
+
+/**
+ * event_start:
+ *
+ * Starts filtering the readings of the devices with a config set through
+ * event_set_config().
+ *
+ * Returns: 0 if successful and a negative errno otherwise.
+ */
+int event_start(void)
+{
+	if (event_ctx.devices)
+		return -EALREADY;
+
+	event_ctx.devices = l_hashmap_string_new();
+
+	return 0;
+}
+
+/**
+ * event_stop:
+ *
+ * Drops every config and stops filtering readings.
+ */
+void event_stop(void)
+{
+	if (!event_ctx.devices)
+		return;
+
+	l_hashmap_destroy(event_ctx.devices, event_device_free);
+	event_ctx.devices = NULL;
+}
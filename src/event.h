@@ -0,0 +1,35 @@
+/*
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2020, CESAR. All rights reserved.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+
+/**
+ * Outbound data event filter header file
+ */
+
+struct knot_cloud_sample;
+
+int event_set_config(const char *id, struct l_queue *config_list);
+void event_remove_device(const char *id);
+bool event_filter(const char *id, const struct knot_cloud_sample *sample);
+void event_commit(const char *id, const struct knot_cloud_sample *sample);
+bool event_is_enabled(void);
+int event_start(void);
+void event_stop(void);
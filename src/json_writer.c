@@ -0,0 +1,308 @@
+/*
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2020, CESAR. All rights reserved.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+
+/**
+ * JSON writer source file
+ *
+ * Writes JSON documents straight into a growable buffer, which is kept
+ * from one document to the next, instead of building a tree of objects
+ * to render them. Commas are written as values are appended, so objects
+ * and arrays are nested without keeping track of them.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include <math.h>
+#include <ell/ell.h>
+
+#include "json_writer.h"
+
+#define MAX(x, y) ((x) > (y) ? (x) : (y))
+
+/* Enough for any integer or double printed with 17 significant digits */
+#define JSON_NUMBER_MAX_LEN 32
+
+static void ensure_room(struct json_writer *writer, size_t len)
+{
+	if (writer->len + len <= writer->size)
+		return;
+
+	writer->size = MAX(writer->size * 2, writer->len + len);
+	writer->buf = l_realloc(writer->buf, writer->size);
+}
+
+static void write_raw(struct json_writer *writer, const char *data,
+		      size_t len)
+{
+	ensure_room(writer, len);
+	memcpy(writer->buf + writer->len, data, len);
+	writer->len += len;
+}
+
+static void write_char(struct json_writer *writer, char c)
+{
+	ensure_room(writer, 1);
+	writer->buf[writer->len++] = c;
+}
+
+/* Separates a value from the previous one of the same object or array */
+static void write_separator(struct json_writer *writer)
+{
+	if (writer->comma)
+		write_char(writer, ',');
+
+	writer->comma = true;
+}
+
+static void write_escaped(struct json_writer *writer, const char *str,
+			  size_t len)
+{
+	static const char hex[] = "0123456789abcdef";
+	unsigned char c;
+	size_t start;
+	size_t i;
+
+	write_char(writer, '"');
+
+	for (i = 0, start = 0; i < len; i++) {
+		c = str[i];
+		if (c >= 0x20 && c != '"' && c != '\\')
+			continue;
+
+		/* Unescaped runs are copied at once */
+		write_raw(writer, str + start, i - start);
+		start = i + 1;
+
+		write_char(writer, '\\');
+
+		switch (c) {
+		case '"':
+		case '\\':
+			write_char(writer, c);
+			break;
+		case '\b':
+			write_char(writer, 'b');
+			break;
+		case '\f':
+			write_char(writer, 'f');
+			break;
+		case '\n':
+			write_char(writer, 'n');
+			break;
+		case '\r':
+			write_char(writer, 'r');
+			break;
+		case '\t':
+			write_char(writer, 't');
+			break;
+		default:
+			write_raw(writer, "u00", 3);
+			write_char(writer, hex[c >> 4]);
+			write_char(writer, hex[c & 0xf]);
+			break;
+		}
+	}
+
+	write_raw(writer, str + start, len - start);
+	write_char(writer, '"');
+}
+
+/**
+ * json_writer_init:
+ * @writer: writer to be initialized
+ * @size: initial size of the buffer, it grows as needed
+ */
+void json_writer_init(struct json_writer *writer, size_t size)
+{
+	writer->size = size ? size : 128;
+	writer->buf = l_malloc(writer->size);
+	writer->len = 0;
+	writer->comma = false;
+}
+
+/**
+ * json_writer_reset:
+ * @writer: writer to be reused
+ *
+ * Starts a new document in the buffer of the previous one, which keeps
+ * the size it grew to.
+ */
+void json_writer_reset(struct json_writer *writer)
+{
+	writer->len = 0;
+	writer->comma = false;
+}
+
+/**
+ * json_writer_release:
+ * @writer: writer whose buffer is freed
+ */
+void json_writer_release(struct json_writer *writer)
+{
+	l_free(writer->buf);
+	writer->buf = NULL;
+	writer->len = 0;
+	writer->size = 0;
+	writer->comma = false;
+}
+
+/**
+ * json_writer_str:
+ * @writer: writer holding the document
+ *
+ * Returns: the document as a NUL terminated string, owned by @writer and
+ * valid until it is written to again.
+ */
+const char *json_writer_str(struct json_writer *writer)
+{
+	ensure_room(writer, 1);
+	writer->buf[writer->len] = '\0';
+
+	return writer->buf;
+}
+
+void json_writer_object_start(struct json_writer *writer)
+{
+	write_separator(writer);
+	write_char(writer, '{');
+	writer->comma = false;
+}
+
+void json_writer_object_end(struct json_writer *writer)
+{
+	write_char(writer, '}');
+	writer->comma = true;
+}
+
+void json_writer_array_start(struct json_writer *writer)
+{
+	write_separator(writer);
+	write_char(writer, '[');
+	writer->comma = false;
+}
+
+void json_writer_array_end(struct json_writer *writer)
+{
+	write_char(writer, ']');
+	writer->comma = true;
+}
+
+/**
+ * json_writer_key:
+ * @writer: writer of an object
+ * @key: name of the member whose value is written next
+ */
+void json_writer_key(struct json_writer *writer, const char *key)
+{
+	write_separator(writer);
+	write_escaped(writer, key, strlen(key));
+	write_char(writer, ':');
+	writer->comma = false;
+}
+
+void json_writer_str_len(struct json_writer *writer, const char *str,
+			 size_t len)
+{
+	write_separator(writer);
+	write_escaped(writer, str, len);
+}
+
+void json_writer_string(struct json_writer *writer, const char *str)
+{
+	json_writer_str_len(writer, str, strlen(str));
+}
+
+void json_writer_bool(struct json_writer *writer, bool value)
+{
+	write_separator(writer);
+
+	if (value)
+		write_raw(writer, "true", 4);
+	else
+		write_raw(writer, "false", 5);
+}
+
+void json_writer_int(struct json_writer *writer, int64_t value)
+{
+	char number[JSON_NUMBER_MAX_LEN];
+	int len;
+
+	len = snprintf(number, sizeof(number), "%" PRId64, value);
+
+	write_separator(writer);
+	write_raw(writer, number, len);
+}
+
+void json_writer_uint(struct json_writer *writer, uint64_t value)
+{
+	char number[JSON_NUMBER_MAX_LEN];
+	int len;
+
+	len = snprintf(number, sizeof(number), "%" PRIu64, value);
+
+	write_separator(writer);
+	write_raw(writer, number, len);
+}
+
+/*
+ * Doubles are written as json-c does, so that they read back the same and
+ * integral values are still told apart from integers.
+ */
+void json_writer_double(struct json_writer *writer, double value)
+{
+	char number[JSON_NUMBER_MAX_LEN];
+	int len;
+
+	write_separator(writer);
+
+	if (isnan(value)) {
+		write_raw(writer, "NaN", 3);
+		return;
+	}
+
+	if (isinf(value)) {
+		if (value > 0)
+			write_raw(writer, "Infinity", 8);
+		else
+			write_raw(writer, "-Infinity", 9);
+		return;
+	}
+
+	len = snprintf(number, sizeof(number), "%.17g", value);
+	write_raw(writer, number, len);
+
+	if (!strpbrk(number, ".eE"))
+		write_raw(writer, ".0", 2);
+}
+
+void json_writer_null(struct json_writer *writer)
+{
+	write_separator(writer);
+	write_raw(writer, "null", 4);
+}
@@ -0,0 +1,49 @@
+/*
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2020, CESAR. All rights reserved.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+/**
+ * JSON writer header file
+ */
+
+struct json_writer {
+	char *buf;
+	size_t len;
+	size_t size;
+	bool comma; /* A value was written, the next one is separated */
+};
+
+void json_writer_init(struct json_writer *writer, size_t size);
+void json_writer_reset(struct json_writer *writer);
+void json_writer_release(struct json_writer *writer);
+const char *json_writer_str(struct json_writer *writer);
+void json_writer_object_start(struct json_writer *writer);
+void json_writer_object_end(struct json_writer *writer);
+void json_writer_array_start(struct json_writer *writer);
+void json_writer_array_end(struct json_writer *writer);
+void json_writer_key(struct json_writer *writer, const char *key);
+void json_writer_str_len(struct json_writer *writer, const char *str,
+			 size_t len);
+void json_writer_string(struct json_writer *writer, const char *str);
+void json_writer_bool(struct json_writer *writer, bool value);
+void json_writer_int(struct json_writer *writer, int64_t value);
+void json_writer_uint(struct json_writer *writer, uint64_t value);
+void json_writer_double(struct json_writer *writer, double value);
+void json_writer_null(struct json_writer *writer);
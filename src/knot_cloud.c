@@ -41,11 +41,76 @@
 #include "parser.h"
 #include "log.h"
 #include "knot_cloud.h"
+#include "coalesce.h"
+#include "submit.h"
+#include "event.h"
+#include "msgpack.h"
+#include "json_writer.h"
+
+/* AMQP routing keys are short strings, at most 255 bytes long */
+#define ROUTING_KEY_MAX_LEN 255
+
+struct knot_cloud_handler {
+	knot_cloud_cb_t cb;
+	void *user_data;
+};
+
+/* Where a received message goes, after its routing key */
+struct knot_cloud_route {
+	int msg_type;
+	char *device_id; /* Thing the event is addressed to, if any */
+};
 
 knot_cloud_cb_t knot_cloud_cb;
 char *user_auth_token;
 char *knot_cloud_events[MSG_TYPES_LENGTH];
 
+/* Routing key of each event bound to the queue to its route */
+static struct l_hashmap *knot_cloud_routes;
+/* Ids of the things served by the gateway along with the one read from */
+static struct l_hashmap *knot_cloud_things;
+static struct knot_cloud_handler handlers[MSG_TYPES_LENGTH];
+
+static enum knot_cloud_encoding data_encoding = KNOT_CLOUD_ENCODING_JSON;
+
+/* Bodies are written here, the buffer is reused from message to message */
+static struct json_writer body_writer;
+
+/* Device data is cheap to lose, so the cloud doesn't keep it on disk */
+static struct knot_cloud_publish_options
+		publish_options[KNOT_CLOUD_PUBLISH_TYPES_LENGTH] = {
+	[KNOT_CLOUD_PUBLISH_REGISTER] = {
+		MQ_MSG_EXPIRATION_TIME_MS, 0, KNOT_CLOUD_DELIVERY_PERSISTENT
+	},
+	[KNOT_CLOUD_PUBLISH_UNREGISTER] = {
+		MQ_MSG_EXPIRATION_TIME_MS, 0, KNOT_CLOUD_DELIVERY_PERSISTENT
+	},
+	[KNOT_CLOUD_PUBLISH_AUTH] = {
+		MQ_MSG_EXPIRATION_TIME_MS, 0, KNOT_CLOUD_DELIVERY_PERSISTENT
+	},
+	[KNOT_CLOUD_PUBLISH_CONFIG] = {
+		MQ_MSG_EXPIRATION_TIME_MS, 0, KNOT_CLOUD_DELIVERY_PERSISTENT
+	},
+	[KNOT_CLOUD_PUBLISH_LIST] = {
+		MQ_MSG_EXPIRATION_TIME_MS, 0, KNOT_CLOUD_DELIVERY_PERSISTENT
+	},
+	[KNOT_CLOUD_PUBLISH_DATA] = {
+		MQ_MSG_EXPIRATION_TIME_MS, 0, KNOT_CLOUD_DELIVERY_TRANSIENT
+	}
+};
+
+static void set_publish_options(mq_message_data_t *mq_message,
+			const struct knot_cloud_publish_options *options)
+{
+	mq_message->expiration_ms = options->expiration_ms;
+	mq_message->priority = options->priority;
+
+	if (options->delivery_mode == KNOT_CLOUD_DELIVERY_TRANSIENT)
+		mq_message->delivery_mode = MQ_DELIVERY_MODE_TRANSIENT;
+	else
+		mq_message->delivery_mode = MQ_DELIVERY_MODE_PERSISTENT;
+}
+
 static void knot_cloud_device_free(void *data)
 {
 	struct knot_cloud_device *device = data;
@@ -62,17 +127,45 @@ static void knot_cloud_device_free(void *data)
 
 static void knot_cloud_msg_destroy(struct knot_cloud_msg *msg)
 {
-	if (msg->type == UPDATE_MSG || msg->type == REQUEST_MSG)
+	/* The token shares its storage with the list */
+	switch (msg->type) {
+	case UPDATE_MSG:
+	case REQUEST_MSG:
 		l_queue_destroy(msg->list, l_free);
-	else if (msg->type == LIST_MSG)
+		break;
+	case CONFIG_MSG:
+		/* The config entries are handed over to the read callback */
+		l_queue_destroy(msg->list, NULL);
+		break;
+	case LIST_MSG:
 		l_queue_destroy(msg->list, knot_cloud_device_free);
-	if (msg->token) {
+		break;
+	case REGISTER_MSG:
 		l_free(msg->token);
-		msg->token = NULL;
+		break;
+	case UNREGISTER_MSG:
+	case AUTH_MSG:
+	case MSG_TYPES_LENGTH:
+	default:
+		break;
 	}
+
+	l_free((char *) msg->device_id);
+	l_free((char *) msg->error);
 	l_free(msg);
 }
 
+/* Destroys a message no callback was given, config entries included */
+static void knot_cloud_msg_discard(struct knot_cloud_msg *msg)
+{
+	if (msg->type == CONFIG_MSG) {
+		l_queue_destroy(msg->list, l_free);
+		msg->list = NULL;
+	}
+
+	knot_cloud_msg_destroy(msg);
+}
+
 static void *create_device_item(const char *id, const char *name,
 				struct l_queue *config_list)
 {
@@ -87,60 +180,143 @@ static void *create_device_item(const char *id, const char *name,
 	return device;
 }
 
-static int map_routing_key_to_msg_type(const char *routing_key)
+static void route_free(void *data)
 {
-	int msg_type;
+	struct knot_cloud_route *route = data;
 
-	for (msg_type = UPDATE_MSG; msg_type < MSG_TYPES_LENGTH; msg_type++) {
-		if (!strcmp(routing_key, knot_cloud_events[msg_type]))
-			return msg_type;
+	if (unlikely(!route))
+		return;
+
+	l_free(route->device_id);
+	l_free(route);
+}
+
+static void add_route(const char *routing_key, int msg_type,
+		      const char *device_id)
+{
+	struct knot_cloud_route *route;
+	void *old_route;
+
+	route = l_new(struct knot_cloud_route, 1);
+	route->msg_type = msg_type;
+	route->device_id = l_strdup(device_id);
+
+	l_hashmap_replace(knot_cloud_routes, routing_key, route, &old_route);
+	route_free(old_route);
+}
+
+static const struct knot_cloud_route *lookup_route(const mq_view_t *routing_key)
+{
+	char key[ROUTING_KEY_MAX_LEN + 1];
+
+	if (!knot_cloud_routes || routing_key->len > ROUTING_KEY_MAX_LEN)
+		return NULL;
+
+	memcpy(key, routing_key->ptr, routing_key->len);
+	key[routing_key->len] = '\0';
+
+	return l_hashmap_lookup(knot_cloud_routes, key);
+}
+
+static bool view_equal(const mq_view_t *view, const char *str)
+{
+	return view->len == strlen(str) && !memcmp(view->ptr, str, view->len);
+}
+
+/*
+ * The cloud only sends device updates as MessagePack, other messages are
+ * rejected.
+ */
+static struct knot_cloud_msg *create_msgpack_msg(
+					const mq_received_message_t *message,
+					int msg_type)
+{
+	struct knot_cloud_msg *msg = l_new(struct knot_cloud_msg, 1);
+	const uint8_t *body = message->body.ptr;
+	size_t body_len = message->body.len;
+
+	msg->type = msg_type;
+	if (msg->type != UPDATE_MSG) {
+		l_error("Unsupported MessagePack event %.*s",
+			(int) message->routing_key.len,
+			(const char *) message->routing_key.ptr);
+		knot_cloud_msg_destroy(msg);
+		return NULL;
+	}
+
+	msg->device_id = parser_get_key_str_from_msgpack(body, body_len,
+					KNOT_JSON_FIELD_DEVICE_ID);
+	msg->error = parser_get_key_str_from_msgpack(body, body_len,
+					KNOT_JSON_FIELD_ERROR);
+	msg->list = parser_update_msgpack_to_list(body, body_len);
+
+	if (!msg->device_id || !msg->list) {
+		l_error("Ill-formed MessagePack message");
+		knot_cloud_msg_destroy(msg);
+		return NULL;
 	}
 
-	return -1;
+	return msg;
 }
 
-static struct knot_cloud_msg *create_msg(const char *routing_key,
-					 const char *json_str)
+/*
+ * The body is parsed in place, it doesn't need to be NUL terminated. It is
+ * parsed once and every field is extracted from the same tree.
+ */
+static struct knot_cloud_msg *create_msg(const mq_received_message_t *message,
+					 int msg_type)
 {
+	json_object *jso;
 	bool has_err;
+	struct knot_cloud_msg *msg;
 
-	struct knot_cloud_msg *msg = l_new(struct knot_cloud_msg, 1);
+	if (view_equal(&message->content_type, MSGPACK_CONTENT_TYPE))
+		return create_msgpack_msg(message, msg_type);
+
+	jso = parser_json_parse((const char *) message->body.ptr,
+				message->body.len);
+	if (!jso) {
+		l_error("Ill-formed JSON message");
+		return NULL;
+	}
+
+	msg = l_new(struct knot_cloud_msg, 1);
 
-	msg->type = map_routing_key_to_msg_type(routing_key);
+	msg->type = msg_type;
 
 	has_err = false;
 	if (msg->type == LIST_MSG) {
 		msg->device_id = NULL;
 	} else {
-		msg->device_id = parser_get_key_str_from_json_str(json_str,
+		msg->device_id = parser_get_key_str_from_json(jso,
 			KNOT_JSON_FIELD_DEVICE_ID);
 		has_err = msg->device_id ? false : true;
 	}
 
-	msg->error = parser_get_key_str_from_json_str(json_str,
-			KNOT_JSON_FIELD_ERROR);
+	msg->error = parser_get_key_str_from_json(jso, KNOT_JSON_FIELD_ERROR);
 
 	if (msg->error)
-		has_err = parser_is_key_str_or_null(json_str,
+		has_err = parser_is_key_str_or_null(jso,
 			KNOT_JSON_FIELD_ERROR) ? false : true;
 
 	if (has_err) {
 		l_error("Ill-formed JSON message");
+		json_object_put(jso);
 		knot_cloud_msg_destroy(msg);
 		return NULL;
 	}
 
 	switch (msg->type) {
 	case UPDATE_MSG:
-		msg->list = parser_update_to_list(json_str);
+		msg->list = parser_update_to_list(jso);
 		has_err = msg->list ? false : true;
 		break;
 	case REQUEST_MSG:
-		msg->list = parser_request_to_list(json_str);
+		msg->list = parser_request_to_list(jso);
 		has_err = msg->list ? false : true;
 		break;
 	case REGISTER_MSG:
-		msg->token = parser_get_key_str_from_json_str(json_str,
+		msg->token = parser_get_key_str_from_json(jso,
 			KNOT_JSON_FIELD_DEVICE_TOKEN);
 		has_err = msg->token ? false : true;
 		break;
@@ -148,21 +324,24 @@ static struct knot_cloud_msg *create_msg(const char *routing_key,
 	case AUTH_MSG:
 		break;
 	case CONFIG_MSG:
-		msg->list = parser_config_to_list(json_str);
+		msg->list = parser_config_to_list(jso);
 		has_err = msg->list ? false : true;
 		break;
 	case LIST_MSG:
-		msg->list = parser_queue_from_json_array(json_str,
+		msg->list = parser_queue_from_json_array(jso,
 				create_device_item);
 		has_err = msg->list ? false : true;
 		break;
 	case MSG_TYPES_LENGTH:
 	default:
-		l_error("Unknown event %s", routing_key);
+		l_error("Unknown event %.*s", (int) message->routing_key.len,
+			(const char *) message->routing_key.ptr);
 		has_err = true;
 		break;
 	}
 
+	json_object_put(jso);
+
 	if (has_err) {
 		l_error("Ill-formed JSON message");
 		knot_cloud_msg_destroy(msg);
@@ -172,6 +351,18 @@ static struct knot_cloud_msg *create_msg(const char *routing_key,
 	return msg;
 }
 
+static void track_device_config(const struct knot_cloud_msg *msg)
+{
+	if (!event_is_enabled() || msg->error)
+		return;
+
+	/* Readings are filtered with the config the cloud has accepted */
+	if (msg->type == CONFIG_MSG)
+		event_set_config(msg->device_id, msg->list);
+	else if (msg->type == UNREGISTER_MSG)
+		event_remove_device(msg->device_id);
+}
+
 /**
  * Callback function to consume and parse the received message from AMQP queue
  * and call the respective handling callback function. In case of a error on
@@ -179,22 +370,120 @@ static struct knot_cloud_msg *create_msg(const char *routing_key,
  *
  * Returns true if the message envelope was consumed or returns false otherwise.
  */
-static bool on_amqp_receive_message(const char *exchange,
-				    const char *routing_key,
-				    const char *body, void *user_data)
+static bool on_amqp_receive_message(const mq_received_message_t *message,
+				    void *user_data)
 {
+	const struct knot_cloud_handler *handler;
+	const struct knot_cloud_route *route;
 	struct knot_cloud_msg *msg;
 	bool consumed = true;
+	bool tracked;
+	int msg_type;
+
+	route = lookup_route(&message->routing_key);
+	if (!route) {
+		l_error("Unknown event %.*s", (int) message->routing_key.len,
+			(const char *) message->routing_key.ptr);
+		return true;
+	}
+
+	msg_type = route->msg_type;
+	handler = &handlers[msg_type];
+	tracked = event_is_enabled() &&
+		  (msg_type == CONFIG_MSG || msg_type == UNREGISTER_MSG);
+
+	/* Nobody is interested in the message, don't bother parsing it */
+	if (!handler->cb && !knot_cloud_cb && !tracked)
+		return true;
+
+	msg = create_msg(message, msg_type);
+	if (!msg)
+		return true;
+
+	/* A thing only takes the data events addressed to it */
+	if (route->device_id && msg->device_id &&
+	    strcmp(route->device_id, msg->device_id)) {
+		l_error("Event for %s received as %s", msg->device_id,
+			route->device_id);
+		knot_cloud_msg_discard(msg);
+		return true;
+	}
+
+	track_device_config(msg);
 
-	msg = create_msg(routing_key, body);
-	if (msg) {
+	if (handler->cb) {
+		consumed = handler->cb(msg, handler->user_data);
+	} else if (knot_cloud_cb) {
 		consumed = knot_cloud_cb(msg, user_data);
-		knot_cloud_msg_destroy(msg);
+	} else {
+		/* Only parsed for the event filter, which copies the config */
+		knot_cloud_msg_discard(msg);
+		return true;
 	}
 
+	knot_cloud_msg_destroy(msg);
+
 	return consumed;
 }
 
+static void set_data_event(char *key, size_t size, const char *id,
+			   int msg_type)
+{
+	snprintf(key, size, "%s.%s.%s", MQ_EVENT_PREFIX_DEVICE, id,
+		 msg_type == UPDATE_MSG ? MQ_EVENT_POSTFIX_DATA_UPDATE :
+					  MQ_EVENT_POSTFIX_DATA_REQUEST);
+}
+
+/*
+ * Binds the data events of a thing to the queue, so that they are received
+ * along with the ones of the other things.
+ */
+static int bind_thing(const char *id)
+{
+	char routing_key[ROUTING_KEY_MAX_LEN + 1];
+	int msg_type;
+
+	for (msg_type = UPDATE_MSG; msg_type <= REQUEST_MSG; msg_type++) {
+		set_data_event(routing_key, sizeof(routing_key), id, msg_type);
+
+		if (mq_prepare_direct_queue(MQ_EXCHANGE_DEVICE, routing_key)) {
+			l_error("Error on bind events of thing %s", id);
+			return -1;
+		}
+
+		add_route(routing_key, msg_type, id);
+	}
+
+	return 0;
+}
+
+static void unbind_thing(const char *id)
+{
+	char routing_key[ROUTING_KEY_MAX_LEN + 1];
+	int msg_type;
+
+	for (msg_type = UPDATE_MSG; msg_type <= REQUEST_MSG; msg_type++) {
+		set_data_event(routing_key, sizeof(routing_key), id, msg_type);
+
+		/* The thing read from keeps its events */
+		if (!strcmp(routing_key, knot_cloud_events[msg_type]))
+			continue;
+
+		route_free(l_hashmap_remove(knot_cloud_routes, routing_key));
+
+		if (mq_unbind_direct_queue(MQ_EXCHANGE_DEVICE, routing_key))
+			l_error("Error on unbind events of thing %s", id);
+	}
+}
+
+static void bind_thing_foreach(const void *key, void *value, void *user_data)
+{
+	int *err = user_data;
+
+	if (bind_thing(key))
+		*err = -1;
+}
+
 static int create_cloud_queue(const char *id)
 {
 	char queue_fog_name[100];
@@ -204,7 +493,7 @@ static int create_cloud_queue(const char *id)
 	snprintf(queue_fog_name, sizeof(queue_fog_name), "%s-%s",
 		 MQ_QUEUE_FOG_OUT, id);
 
-	err = mq_declare_new_queue(queue_fog_name);
+	err = mq_declare_new_queue(queue_fog_name, id);
 	if (err < 0) {
 		l_error("Error on declare a new queue");
 		return err;
@@ -219,6 +508,13 @@ static int create_cloud_queue(const char *id)
 		}
 	}
 
+	/* The queue was declared again, so are the bindings of the things */
+	l_hashmap_foreach(knot_cloud_things, bind_thing_foreach, &err);
+	if (err) {
+		l_error("Error on set up queue to consume");
+		return -1;
+	}
+
 	err = mq_consumer_queue();
 	if (err) {
 		l_error("Error on start a queue consumer");
@@ -232,6 +528,9 @@ static void destroy_knot_cloud_events(void)
 {
 	int msg_type;
 
+	l_hashmap_destroy(knot_cloud_routes, route_free);
+	knot_cloud_routes = NULL;
+
 	for (msg_type = UPDATE_MSG; msg_type < MSG_TYPES_LENGTH; msg_type++) {
 		if (knot_cloud_events[msg_type] != NULL) {
 			l_free(knot_cloud_events[msg_type]);
@@ -246,6 +545,7 @@ static int set_knot_cloud_events(const char *id)
 	char binding_key_list_reply[100];
 	char binding_key_update[100];
 	char binding_key_request[100];
+	int msg_type;
 
 	snprintf(binding_key_auth_reply, sizeof(binding_key_auth_reply),
 		 "%s-%s", MQ_EVENT_AUTH_REPLY, id);
@@ -277,6 +577,11 @@ static int set_knot_cloud_events(const char *id)
 	knot_cloud_events[LIST_MSG] =
 				l_strdup(binding_key_list_reply);
 
+	knot_cloud_routes = l_hashmap_string_new();
+	for (msg_type = UPDATE_MSG; msg_type < MSG_TYPES_LENGTH; msg_type++)
+		add_route(knot_cloud_events[msg_type], msg_type,
+			  msg_type <= REQUEST_MSG ? id : NULL);
+
 	return 0;
 }
 
@@ -323,10 +628,10 @@ int knot_cloud_set_log_priority(int priority)
  */
 int knot_cloud_register_device(const char *id, const char *name)
 {
-	char *json_str;
+	const char *json_str;
 	int result;
 
-	json_str = parser_device_json_create(id, name);
+	json_str = parser_device_json_create(&body_writer, id, name);
 	if (!json_str)
 		return KNOT_ERR_CLOUD_FAILURE;
 
@@ -338,21 +643,22 @@ int knot_cloud_register_device(const char *id, const char *name)
 	 *	Name: device.register
 	 * Headers
 	 *	[0]: User Token
-	 * Expiration
-	 *	2000 ms
+	 * Expiration, priority and delivery mode
+	 *	Set with knot_cloud_set_publish_options()
 	 */
 	mq_message_data_t mq_message = {
 		MQ_MESSAGE_TYPE_DIRECT, MQ_EXCHANGE_DEVICE,
-		MQ_CMD_DEVICE_REGISTER, MQ_MSG_EXPIRATION_TIME_MS, json_str,
-		NULL, NULL
+		MQ_CMD_DEVICE_REGISTER, 0, json_str,
+		NULL, NULL, id
 	};
 
+	set_publish_options(&mq_message,
+			    &publish_options[KNOT_CLOUD_PUBLISH_REGISTER]);
+
 	result = mq_publish_message(&mq_message);
 	if (result < 0)
 		result = KNOT_ERR_CLOUD_FAILURE;
 
-	l_free(json_str);
-
 	return result;
 }
 
@@ -368,10 +674,10 @@ int knot_cloud_register_device(const char *id, const char *name)
  */
 int knot_cloud_unregister_device(const char *id)
 {
-	char *json_str;
+	const char *json_str;
 	int result;
 
-	json_str = parser_unregister_json_create(id);
+	json_str = parser_unregister_json_create(&body_writer, id);
 	if (!json_str)
 		return KNOT_ERR_CLOUD_FAILURE;
 
@@ -383,21 +689,22 @@ int knot_cloud_unregister_device(const char *id)
 	 *	Name: device.unregister
 	 * Headers
 	 *	[0]: User Token
-	 * Expiration
-	 *	2000 ms
+	 * Expiration, priority and delivery mode
+	 *	Set with knot_cloud_set_publish_options()
 	 */
 	mq_message_data_t mq_message = {
 		MQ_MESSAGE_TYPE_DIRECT, MQ_EXCHANGE_DEVICE,
-		MQ_CMD_DEVICE_UNREGISTER, MQ_MSG_EXPIRATION_TIME_MS, json_str,
-		NULL, NULL
+		MQ_CMD_DEVICE_UNREGISTER, 0, json_str,
+		NULL, NULL, id
 	};
 
+	set_publish_options(&mq_message,
+			    &publish_options[KNOT_CLOUD_PUBLISH_UNREGISTER]);
+
 	result = mq_publish_message(&mq_message);
 	if (result < 0)
 		return KNOT_ERR_CLOUD_FAILURE;
 
-	l_free(json_str);
-
 	return 0;
 }
 
@@ -414,10 +721,10 @@ int knot_cloud_unregister_device(const char *id)
  */
 int knot_cloud_auth_device(const char *id, const char *token)
 {
-	char *json_str;
+	const char *json_str;
 	int result;
 
-	json_str = parser_auth_json_create(id, token);
+	json_str = parser_auth_json_create(&body_writer, id, token);
 	if (!json_str)
 		return KNOT_ERR_CLOUD_FAILURE;
 
@@ -429,20 +736,21 @@ int knot_cloud_auth_device(const char *id, const char *token)
 	 *	Name: device.auth
 	 * Headers
 	 *	[0]: User Token
-	 * Expiration
-	 *	2000 ms
+	 * Expiration, priority and delivery mode
+	 *	Set with knot_cloud_set_publish_options()
 	 */
 	mq_message_data_t mq_message = {
 		MQ_MESSAGE_TYPE_DIRECT_RPC, MQ_EXCHANGE_DEVICE,
-		MQ_CMD_DEVICE_AUTH, MQ_MSG_EXPIRATION_TIME_MS, json_str,
-		knot_cloud_events[AUTH_MSG], MQ_DEFAULT_CORRELATION_ID
+		MQ_CMD_DEVICE_AUTH, 0, json_str,
+		knot_cloud_events[AUTH_MSG], MQ_DEFAULT_CORRELATION_ID, id
 	 };
+
+	set_publish_options(&mq_message,
+			    &publish_options[KNOT_CLOUD_PUBLISH_AUTH]);
 	result = mq_publish_message(&mq_message);
 	if (result < 0)
 		result = KNOT_ERR_CLOUD_FAILURE;
 
-	l_free(json_str);
-
 	return result;
 }
 
@@ -457,10 +765,11 @@ int knot_cloud_auth_device(const char *id, const char *token)
  */
 int knot_cloud_update_config(const char *id, struct l_queue *config_list)
 {
-	char *json_str;
+	const char *json_str;
 	int result;
 
-	json_str = parser_config_create_object(id, config_list);
+	json_str = parser_config_create_object(&body_writer, id,
+					       config_list);
 	if (!json_str)
 		return KNOT_ERR_CLOUD_FAILURE;
 
@@ -472,22 +781,23 @@ int knot_cloud_update_config(const char *id, struct l_queue *config_list)
 	 *	Name: device.config.sent
 	 * Headers
 	 *	[0]: User Token
-	 * Expiration
-	 *	2000 ms
+	 * Expiration, priority and delivery mode
+	 *	Set with knot_cloud_set_publish_options()
 	 */
 	mq_message_data_t mq_message = {
 		MQ_MESSAGE_TYPE_DIRECT,
 		MQ_EXCHANGE_DEVICE, MQ_CMD_CONFIG_SENT,
-		MQ_MSG_EXPIRATION_TIME_MS, json_str,
-		NULL, NULL
+		0, json_str,
+		NULL, NULL, id
 	};
 
+	set_publish_options(&mq_message,
+			    &publish_options[KNOT_CLOUD_PUBLISH_CONFIG]);
+
 	result = mq_publish_message(&mq_message);
 	if (result < 0)
 		result = KNOT_ERR_CLOUD_FAILURE;
 
-	l_free(json_str);
-
 	return result;
 }
 
@@ -500,12 +810,13 @@ int knot_cloud_update_config(const char *id, struct l_queue *config_list)
  */
 int knot_cloud_list_devices(void)
 {
-	json_object *jobj_empty;
 	const char *json_str;
 	int result;
 
-	jobj_empty = json_object_new_object();
-	json_str = json_object_to_json_string(jobj_empty);
+	json_writer_reset(&body_writer);
+	json_writer_object_start(&body_writer);
+	json_writer_object_end(&body_writer);
+	json_str = json_writer_str(&body_writer);
 
 	/**
 	 * Exchange
@@ -515,20 +826,103 @@ int knot_cloud_list_devices(void)
 	 *	Name: device.list
 	 * Headers
 	 *	[0]: User Token
-	 * Expiration
-	 *	2000 ms
+	 * Expiration, priority and delivery mode
+	 *	Set with knot_cloud_set_publish_options()
 	 */
 	mq_message_data_t mq_message = {
 		MQ_MESSAGE_TYPE_DIRECT_RPC, MQ_EXCHANGE_DEVICE,
-		MQ_CMD_DEVICE_LIST, MQ_MSG_EXPIRATION_TIME_MS, json_str,
-		knot_cloud_events[LIST_MSG], MQ_DEFAULT_CORRELATION_ID
+		MQ_CMD_DEVICE_LIST, 0, json_str,
+		knot_cloud_events[LIST_MSG], MQ_DEFAULT_CORRELATION_ID, NULL
 	};
 
+	set_publish_options(&mq_message,
+			    &publish_options[KNOT_CLOUD_PUBLISH_LIST]);
+
 	result = mq_publish_message(&mq_message);
 	if (result < 0)
 		result = KNOT_ERR_CLOUD_FAILURE;
 
-	json_object_put(jobj_empty);
+	return result;
+}
+
+static int publish_data(const char *id,
+			const struct knot_cloud_sample *samples, size_t n,
+			const struct knot_cloud_publish_options *options,
+			knot_cloud_publish_done_cb_t done_cb, void *user_data)
+{
+	char *msgpack_body = NULL;
+	const char *json_str;
+	size_t body_len = 0;
+	int result;
+
+	if (data_encoding == KNOT_CLOUD_ENCODING_MSGPACK)
+		json_str = msgpack_body = parser_data_batch_create_msgpack(id,
+							samples, n, &body_len);
+	else
+		json_str = parser_data_batch_create_object(&body_writer, id,
+							   samples, n);
+	if (!json_str)
+		return KNOT_ERR_CLOUD_FAILURE;
+
+	/**
+	 * Exchange
+	 *	Type: Fanout
+	 *	Name: data.sent
+	 * Expiration, priority and delivery mode
+	 *	Set with knot_cloud_set_publish_options()
+	 * Content type
+	 *	Set with knot_cloud_set_encoding()
+	 */
+	mq_message_data_t mq_message = {
+		MQ_MESSAGE_TYPE_FANOUT, MQ_EXCHANGE_DATA_SENT,
+		NULL, 0, json_str,
+		NULL, NULL, id
+	};
+
+	set_publish_options(&mq_message, options);
+
+	if (body_len) {
+		mq_message.body_len = body_len;
+		mq_message.content_type = MSGPACK_CONTENT_TYPE;
+	}
+
+	if (done_cb)
+		result = mq_publish_message_confirm(&mq_message, done_cb,
+						    user_data);
+	else
+		result = mq_publish_message(&mq_message);
+	if (result < 0 && result != -EAGAIN)
+		result = KNOT_ERR_CLOUD_FAILURE;
+
+	l_free(msgpack_body);
+
+	return result;
+}
+
+static int publish_sample(const char *id,
+			  const struct knot_cloud_sample *sample)
+{
+	int result;
+
+	if (!event_filter(id, sample))
+		return 0;
+
+	/* Coalesced readings are committed once their batch is sent */
+	if (coalesce_is_enabled()) {
+		result = coalesce_push(id, sample);
+		if (result < 0 && result != -EAGAIN)
+			result = KNOT_ERR_CLOUD_FAILURE;
+
+		return result;
+	}
+
+	result = publish_data(id, sample, 1,
+			      &publish_options[KNOT_CLOUD_PUBLISH_DATA],
+			      NULL, NULL);
+
+	/* A reading not sent is still an event the next time */
+	if (!result)
+		event_commit(id, sample);
 
 	return result;
 }
@@ -543,49 +937,671 @@ int knot_cloud_list_devices(void)
  *
  * Sends device's data to cloud.
  *
- * Returns: 0 if successful and a KNoT error otherwise.
+ * Returns: 0 if successful, -EAGAIN if the cloud can't keep up and a KNoT
+ * error otherwise.
  */
 int knot_cloud_publish_data(const char *id, uint8_t sensor_id,
 			    uint8_t value_type, const knot_value_type *value,
 			    uint8_t kval_len)
 {
-	char *json_str;
+	struct knot_cloud_sample sample = {
+		.sensor_id = sensor_id,
+		.value_type = value_type,
+		.value = *value,
+		.kval_len = kval_len
+	};
+
+	return publish_sample(id, &sample);
+}
+
+/**
+ * knot_cloud_publish_data_async:
+ * @id: device id
+ * @sensor_id: schema sensor id
+ * @value_type: schema value type defined in KNoT protocol
+ * @value: value to be sent
+ * @kval_len: length of @value
+ * @done_cb: callback called once the cloud confirms or rejects the data
+ * @user_data: user data provided to @done_cb
+ *
+ * Sends device's data to cloud without waiting for its confirmation. The
+ * result is reported later through @done_cb, which is not called if this
+ * function fails. Requires knot_cloud_set_publish_confirms().
+ *
+ * Returns: 0 if successful, -EAGAIN if the cloud can't keep up and a KNoT
+ * error otherwise.
+ */
+int knot_cloud_publish_data_async(const char *id, uint8_t sensor_id,
+				  uint8_t value_type,
+				  const knot_value_type *value,
+				  uint8_t kval_len,
+				  knot_cloud_publish_done_cb_t done_cb,
+				  void *user_data)
+{
+	struct knot_cloud_sample sample = {
+		.sensor_id = sensor_id,
+		.value_type = value_type,
+		.value = *value,
+		.kval_len = kval_len
+	};
+
+	if (!done_cb)
+		return KNOT_ERR_CLOUD_FAILURE;
+
+	return publish_data(id, &sample, 1,
+			    &publish_options[KNOT_CLOUD_PUBLISH_DATA], done_cb,
+			    user_data);
+}
+
+/**
+ * knot_cloud_publish_data_batch:
+ * @id: device id
+ * @samples: readings from one or more sensors of the device
+ * @n: number of items in @samples
+ *
+ * Sends several readings of a device's sensors to cloud in a single message.
+ *
+ * Returns: 0 if successful, -EAGAIN if the cloud can't keep up and a KNoT
+ * error otherwise.
+ */
+int knot_cloud_publish_data_batch(const char *id,
+				  const struct knot_cloud_sample *samples,
+				  size_t n)
+{
+	struct knot_cloud_sample *events;
+	size_t i, len;
 	int result;
 
-	json_str = parser_data_create_object(id, sensor_id, value_type, value,
-					      kval_len);
-	if (!json_str)
+	if (!samples || !n)
 		return KNOT_ERR_CLOUD_FAILURE;
 
-	/**
-	 * Exchange
-	 *	Type: Fanout
-	 *	Name: data.sent
-	 * Expiration
-	 *	2000 ms
-	 */
-	mq_message_data_t mq_message = {
-		MQ_MESSAGE_TYPE_FANOUT, MQ_EXCHANGE_DATA_SENT,
-		NULL, MQ_MSG_EXPIRATION_TIME_MS, json_str,
-		NULL, NULL
-	};
+	if (!event_is_enabled())
+		return publish_data(id, samples, n,
+				    &publish_options[KNOT_CLOUD_PUBLISH_DATA],
+				    NULL, NULL);
 
-	result = mq_publish_message(&mq_message);
-	if (result < 0)
-		result = KNOT_ERR_CLOUD_FAILURE;
+	events = l_new(struct knot_cloud_sample, n);
+	for (i = 0, len = 0; i < n; i++) {
+		if (event_filter(id, &samples[i]))
+			events[len++] = samples[i];
+	}
 
-	l_free(json_str);
+	result = len ? publish_data(id, events, len,
+				    &publish_options[KNOT_CLOUD_PUBLISH_DATA],
+				    NULL, NULL) : 0;
+
+	/* A reading not sent is still an event the next time */
+	for (i = 0; !result && i < len; i++)
+		event_commit(id, &events[i]);
+
+	l_free(events);
 
 	return result;
 }
 
+/**
+ * knot_cloud_publish_data_with_options:
+ * @id: device id
+ * @samples: readings from one or more sensors of the device
+ * @n: number of items in @samples
+ * @options: expiration, priority and delivery mode of this message only
+ *
+ * Sends several readings of a device's sensors to cloud in a single message
+ * published with @options instead of the defaults set with
+ * knot_cloud_set_publish_options().
+ *
+ * Returns: 0 if successful, -EAGAIN if the cloud can't keep up and a KNoT
+ * error otherwise.
+ */
+int knot_cloud_publish_data_with_options(const char *id,
+			const struct knot_cloud_sample *samples, size_t n,
+			const struct knot_cloud_publish_options *options)
+{
+	if (!samples || !n || !options)
+		return KNOT_ERR_CLOUD_FAILURE;
+
+	return publish_data(id, samples, n, options, NULL, NULL);
+}
+
+/**
+ * knot_cloud_set_publish_options:
+ * @type: type of the messages the options apply to
+ * @options: expiration, priority and delivery mode
+ *
+ * Sets the options messages of @type are published with. By default every
+ * message expires after 2000 ms without a priority, and only device data
+ * isn't persisted by the cloud.
+ *
+ * Returns: 0 if successful and a KNoT error otherwise.
+ */
+int knot_cloud_set_publish_options(enum knot_cloud_publish_type type,
+			const struct knot_cloud_publish_options *options)
+{
+	if (type >= KNOT_CLOUD_PUBLISH_TYPES_LENGTH || !options)
+		return KNOT_ERR_CLOUD_FAILURE;
+
+	if (options->delivery_mode != KNOT_CLOUD_DELIVERY_PERSISTENT &&
+	    options->delivery_mode != KNOT_CLOUD_DELIVERY_TRANSIENT)
+		return KNOT_ERR_CLOUD_FAILURE;
+
+	publish_options[type] = *options;
+
+	return 0;
+}
+
+/**
+ * knot_cloud_set_encoding:
+ * @encoding: format device data is sent in
+ *
+ * Sets the format of the data messages, labeled with their content type so
+ * the cloud knows how to decode them. MessagePack messages are smaller and
+ * cheaper to build than JSON ones and carry raw values without base64.
+ * Received messages are always decoded according to their content type.
+ *
+ * Returns: 0 if successful and a KNoT error otherwise.
+ */
+int knot_cloud_set_encoding(enum knot_cloud_encoding encoding)
+{
+	if (encoding != KNOT_CLOUD_ENCODING_JSON &&
+	    encoding != KNOT_CLOUD_ENCODING_MSGPACK)
+		return KNOT_ERR_CLOUD_FAILURE;
+
+	data_encoding = encoding;
+
+	return 0;
+}
+
+static int publish_coalesced_data(const char *id,
+				  const struct knot_cloud_sample *samples,
+				  size_t num_samples)
+{
+	size_t i;
+	int result;
+
+	result = publish_data(id, samples, num_samples,
+			      &publish_options[KNOT_CLOUD_PUBLISH_DATA],
+			      NULL, NULL);
+	if (result < 0)
+		return result;
+
+	for (i = 0; i < num_samples; i++)
+		event_commit(id, &samples[i]);
+
+	return 0;
+}
+
+/**
+ * knot_cloud_set_coalescing:
+ * @window_ms: time in milliseconds readings are held, 0 disables coalescing
+ * @max_samples: number of held readings of a device that forces a send
+ *
+ * Makes knot_cloud_publish_data() hold the readings of each device for up
+ * to @window_ms and send them together in a single message. Readings held
+ * when coalescing is disabled or changed are sent right away. While the
+ * cloud can't keep up, held readings wait for the next window, and
+ * knot_cloud_publish_data() returns -EAGAIN once a device holds
+ * @max_samples of them.
+ *
+ * Returns: 0 if successful and a KNoT error otherwise.
+ */
+int knot_cloud_set_coalescing(uint32_t window_ms, size_t max_samples)
+{
+	coalesce_stop();
+
+	if (!window_ms)
+		return 0;
+
+	if (coalesce_start(window_ms, max_samples, publish_coalesced_data) < 0)
+		return KNOT_ERR_CLOUD_FAILURE;
+
+	return 0;
+}
+
+/**
+ * knot_cloud_set_event_filter:
+ * @enable: whether readings that don't trigger an event are dropped
+ *
+ * Makes knot_cloud_publish_data() and knot_cloud_publish_data_batch() send
+ * a reading only if it triggers one of the events in its sensor config:
+ * a change of value, a value below the lower or above the upper threshold,
+ * or the end of the time period since the last reading sent. The config of
+ * each device is taken from the cloud config updates received and from
+ * knot_cloud_set_device_config(). Disabling the filter drops every config.
+ *
+ * Returns: 0 if successful and a KNoT error otherwise.
+ */
+int knot_cloud_set_event_filter(bool enable)
+{
+	event_stop();
+
+	if (!enable)
+		return 0;
+
+	if (event_start() < 0)
+		return KNOT_ERR_CLOUD_FAILURE;
+
+	return 0;
+}
+
+/**
+ * knot_cloud_set_device_config:
+ * @id: device id
+ * @config_list: list of knot_msg_config the cloud has for the device
+ *
+ * Sets the config the readings of @id are filtered with, such as the one
+ * listed by knot_cloud_list_devices(). Requires
+ * knot_cloud_set_event_filter().
+ *
+ * Returns: 0 if successful and a KNoT error otherwise.
+ */
+int knot_cloud_set_device_config(const char *id, struct l_queue *config_list)
+{
+	if (event_set_config(id, config_list) < 0)
+		return KNOT_ERR_CLOUD_FAILURE;
+
+	return 0;
+}
+
+static void on_submitted_data(const char *id,
+			      const struct knot_cloud_sample *sample)
+{
+	int err;
+
+	err = publish_sample(id, sample);
+	if (err)
+		l_error("Failed to publish data submitted for %s: %d", id, err);
+}
+
+/**
+ * knot_cloud_set_submit_queue:
+ * @capacity: number of readings the queue holds, 0 disables the queue
+ *
+ * Sets up a lock-free queue through which knot_cloud_submit_data() hands
+ * readings from any thread to the main loop. Must be called from the main
+ * loop thread before any other thread submits data.
+ *
+ * Returns: 0 if successful and a KNoT error otherwise.
+ */
+int knot_cloud_set_submit_queue(size_t capacity)
+{
+	submit_stop();
+
+	if (!capacity)
+		return 0;
+
+	if (submit_start(capacity, on_submitted_data) < 0)
+		return KNOT_ERR_CLOUD_FAILURE;
+
+	return 0;
+}
+
+/**
+ * knot_cloud_submit_data:
+ * @id: device id
+ * @sensor_id: schema sensor id
+ * @value_type: schema value type defined in KNoT protocol
+ * @value: value to be sent
+ * @kval_len: length of @value
+ *
+ * Thread-safe variant of knot_cloud_publish_data(): copies the reading into
+ * the queue set up by knot_cloud_set_submit_queue() without taking locks or
+ * touching the connection, and the main loop publishes it. Failures while
+ * publishing are only logged.
+ *
+ * Returns: 0 if successful, -EAGAIN if the queue is full and a KNoT error
+ * otherwise.
+ */
+int knot_cloud_submit_data(const char *id, uint8_t sensor_id,
+			   uint8_t value_type, const knot_value_type *value,
+			   uint8_t kval_len)
+{
+	struct knot_cloud_sample sample = {
+		.sensor_id = sensor_id,
+		.value_type = value_type,
+		.value = *value,
+		.kval_len = kval_len
+	};
+	int err;
+
+	err = submit_push(id, &sample);
+	if (err == -EAGAIN)
+		return err;
+
+	return err < 0 ? KNOT_ERR_CLOUD_FAILURE : 0;
+}
+
+/**
+ * knot_cloud_set_connection_pool:
+ * @size: number of connections to the cloud
+ *
+ * Spreads the traffic over several connections to the cloud, each device
+ * always using the same one. Every connection is reestablished on its own
+ * and @connected_cb of knot_cloud_start() is called once all of them are
+ * up. Must be called before knot_cloud_start().
+ *
+ * Returns: 0 if successful and a KNoT error otherwise.
+ */
+int knot_cloud_set_connection_pool(unsigned int size)
+{
+	if (mq_set_pool_size(size) < 0)
+		return KNOT_ERR_CLOUD_FAILURE;
+
+	return 0;
+}
+
+/**
+ * knot_cloud_set_publish_confirms:
+ * @window: maximum number of unconfirmed messages, 0 disables confirms
+ *
+ * Enables publisher confirms, reported by knot_cloud_publish_data_async().
+ * Must be called before knot_cloud_start().
+ *
+ * Returns: 0 if successful and a KNoT error otherwise.
+ */
+int knot_cloud_set_publish_confirms(uint32_t window)
+{
+	if (mq_set_confirm_window(window) < 0)
+		return KNOT_ERR_CLOUD_FAILURE;
+
+	return 0;
+}
+
+/**
+ * knot_cloud_set_compression:
+ * @threshold: size in bytes from which messages are compressed, 0 disables
+ * compression
+ *
+ * Compresses messages of at least @threshold bytes, such as the config of
+ * devices with many sensors, before sending them to the cloud. Compressed
+ * messages received from the cloud, such as large device lists, are always
+ * decompressed.
+ *
+ * Returns: 0 if successful and a KNoT error otherwise.
+ */
+int knot_cloud_set_compression(size_t threshold)
+{
+	if (mq_set_compression(threshold) < 0)
+		return KNOT_ERR_CLOUD_FAILURE;
+
+	return 0;
+}
+
+/**
+ * knot_cloud_set_receive_budget:
+ * @max_msgs: messages handled at most at once, must not be 0
+ * @max_ms: time in milliseconds spent at most handling them, must not be 0
+ *
+ * Bounds how many of the messages received in a burst are handled before
+ * the main loop gets to serve its other sources. By default up to 64
+ * messages are handled within 5 ms.
+ *
+ * Returns: 0 if successful and a KNoT error otherwise.
+ */
+int knot_cloud_set_receive_budget(uint32_t max_msgs, uint32_t max_ms)
+{
+	if (mq_set_receive_budget(max_msgs, max_ms) < 0)
+		return KNOT_ERR_CLOUD_FAILURE;
+
+	return 0;
+}
+
+/**
+ * knot_cloud_set_consumer_ack:
+ * @prefetch: messages received at most before they are acknowledged, 0
+ * disables acknowledgements
+ * @ack_interval_ms: time in milliseconds acks are held at most to be sent
+ * together, 0 acks every message right away
+ *
+ * Makes the cloud hold back messages while @prefetch of them are waiting to
+ * be handled. A message the callback returns false for is put back on the
+ * queue and received again, and dropped if it fails a second time. A
+ * message received again because a connection dropped before it was
+ * acknowledged is dropped on its first failure. Must be called before
+ * knot_cloud_start().
+ *
+ * Returns: 0 if successful and a KNoT error otherwise.
+ */
+int knot_cloud_set_consumer_ack(uint16_t prefetch, uint32_t ack_interval_ms)
+{
+	if (mq_set_consumer_ack(prefetch, ack_interval_ms) < 0)
+		return KNOT_ERR_CLOUD_FAILURE;
+
+	return 0;
+}
+
+/**
+ * knot_cloud_set_buffer:
+ * @capacity: size in bytes of the buffer, 0 disables buffering
+ * @policy: whether the oldest or the newest messages are dropped when full
+ * @drain_rate: messages sent per second after reconnecting, 0 is unlimited
+ *
+ * Keeps messages published while the cloud is unreachable in a buffer of
+ * fixed size and sends them once the connection is back. Must be called
+ * before knot_cloud_start().
+ *
+ * Returns: 0 if successful and a KNoT error otherwise.
+ */
+int knot_cloud_set_buffer(size_t capacity,
+			  enum knot_cloud_buffer_policy policy,
+			  uint32_t drain_rate)
+{
+	mq_outbox_policy mq_policy;
+
+	switch (policy) {
+	case KNOT_CLOUD_BUFFER_DROP_OLDEST:
+		mq_policy = MQ_OUTBOX_DROP_OLDEST;
+		break;
+	case KNOT_CLOUD_BUFFER_DROP_NEWEST:
+		mq_policy = MQ_OUTBOX_DROP_NEWEST;
+		break;
+	default:
+		return KNOT_ERR_CLOUD_FAILURE;
+	}
+
+	if (mq_set_outbox(capacity, mq_policy, drain_rate) < 0)
+		return KNOT_ERR_CLOUD_FAILURE;
+
+	return 0;
+}
+
+/**
+ * knot_cloud_get_buffer_stats:
+ * @stats: filled with the counters of the buffer
+ *
+ * Gets the counters of the buffer set up with knot_cloud_set_buffer().
+ */
+void knot_cloud_get_buffer_stats(struct knot_cloud_buffer_stats *stats)
+{
+	mq_outbox_stats_t mq_stats;
+
+	mq_get_outbox_stats(&mq_stats);
+
+	stats->len = mq_stats.len;
+	stats->buffered = mq_stats.buffered;
+	stats->dropped = mq_stats.dropped;
+	stats->replayed = mq_stats.replayed;
+}
+
+/**
+ * knot_cloud_get_channel_stats:
+ * @channel: channel to get the counters from
+ * @stats: filled with the channel state and counters
+ *
+ * Gets the state and counters of the channel carrying device control
+ * requests or device data, each published on its own AMQP channel.
+ *
+ * Returns: 0 if successful and a KNoT error otherwise.
+ */
+int knot_cloud_get_channel_stats(enum knot_cloud_channel channel,
+				 struct knot_cloud_channel_stats *stats)
+{
+	mq_channel_stats_t mq_stats;
+	mq_channel_class channel_class;
+
+	switch (channel) {
+	case KNOT_CLOUD_CHANNEL_CONTROL:
+		channel_class = MQ_CHANNEL_CONTROL;
+		break;
+	case KNOT_CLOUD_CHANNEL_DATA:
+		channel_class = MQ_CHANNEL_DATA;
+		break;
+	default:
+		return KNOT_ERR_CLOUD_FAILURE;
+	}
+
+	if (mq_get_channel_stats(channel_class, &mq_stats) < 0)
+		return KNOT_ERR_CLOUD_FAILURE;
+
+	stats->open = mq_stats.open;
+	stats->congested = mq_stats.congested;
+	stats->queued = mq_stats.queued;
+	stats->unconfirmed = mq_stats.unconfirmed;
+	stats->published = mq_stats.published;
+	stats->acked = mq_stats.acked;
+	stats->nacked = mq_stats.nacked;
+	stats->reopened = mq_stats.reopened;
+
+	return 0;
+}
+
+/**
+ * knot_cloud_set_spool:
+ * @path: directory to keep the spool files, NULL disables the spool
+ * @segment_size: size in bytes of each spool file
+ *
+ * Keeps messages published while the cloud is unreachable on disk, so they
+ * are sent even if the process restarts in the meantime. When set, it is
+ * used instead of the buffer from knot_cloud_set_buffer(). With
+ * knot_cloud_set_publish_confirms(), messages are kept until the cloud
+ * confirms them.
+ *
+ * Returns: 0 if successful and a KNoT error otherwise.
+ */
+int knot_cloud_set_spool(const char *path, size_t segment_size)
+{
+	if (mq_set_spool(path, segment_size) < 0)
+		return KNOT_ERR_CLOUD_FAILURE;
+
+	return 0;
+}
+
+/**
+ * knot_cloud_set_backpressure:
+ * @high_watermark: bytes waiting to be sent that make publishing fail,
+ *		    0 disables backpressure
+ * @low_watermark: bytes waiting to be sent below which publishing resumes
+ * @backpressure_cb: callback called when crossing the watermarks
+ * @user_data: user data provided to @backpressure_cb
+ *
+ * Keeps the main loop from blocking while the cloud can't keep up. Data
+ * the connection can't take right away waits in a queue. Once it holds
+ * @high_watermark bytes, @backpressure_cb is called with true and
+ * knot_cloud_publish_data() and its variants return -EAGAIN, until the
+ * queue drains to @low_watermark and @backpressure_cb is called with false.
+ * Must be called before knot_cloud_start().
+ *
+ * Returns: 0 if successful and a KNoT error otherwise.
+ */
+int knot_cloud_set_backpressure(size_t high_watermark, size_t low_watermark,
+				knot_cloud_backpressure_cb_t backpressure_cb,
+				void *user_data)
+{
+	if (mq_set_write_queue(high_watermark, low_watermark, backpressure_cb,
+			       user_data) < 0)
+		return KNOT_ERR_CLOUD_FAILURE;
+
+	return 0;
+}
+
+/**
+ * knot_cloud_set_handler:
+ * @msg_type: type of the messages to be handled, such as UPDATE_MSG
+ * @handler_cb: callback to handle messages of @msg_type, NULL to unset it
+ * @user_data: user data provided to @handler_cb
+ *
+ * Routes the messages of @msg_type received from cloud to @handler_cb
+ * instead of the callback of knot_cloud_read_start(). Messages of a type
+ * without any callback are neither parsed nor handled.
+ *
+ * Returns: 0 if successful and a KNoT error if @msg_type is not valid.
+ */
+int knot_cloud_set_handler(enum knot_cloud_msg_type msg_type,
+			   knot_cloud_cb_t handler_cb, void *user_data)
+{
+	if ((unsigned int) msg_type >= MSG_TYPES_LENGTH)
+		return KNOT_ERR_CLOUD_FAILURE;
+
+	handlers[msg_type].cb = handler_cb;
+	handlers[msg_type].user_data = user_data;
+
+	return 0;
+}
+
+/**
+ * knot_cloud_add_thing:
+ * @id: thing id
+ *
+ * Receives the data updates and requests of one more thing on the queue
+ * of knot_cloud_read_start(), so that a gateway serves many things with a
+ * single queue. Things added before knot_cloud_read_start() are bound once
+ * it is called, and bound again whenever it is called.
+ *
+ * Returns: 0 if successful and a KNoT error if @id was already added or
+ * couldn't be bound.
+ */
+int knot_cloud_add_thing(const char *id)
+{
+	if (!id)
+		return KNOT_ERR_CLOUD_FAILURE;
+
+	if (!knot_cloud_things)
+		knot_cloud_things = l_hashmap_string_new();
+
+	if (l_hashmap_lookup(knot_cloud_things, id))
+		return KNOT_ERR_CLOUD_FAILURE;
+
+	/* Not reading yet, it is bound along with the queue */
+	if (knot_cloud_routes && bind_thing(id)) {
+		unbind_thing(id);
+		return KNOT_ERR_CLOUD_FAILURE;
+	}
+
+	l_hashmap_insert(knot_cloud_things, id, L_UINT_TO_PTR(true));
+
+	return 0;
+}
+
+/**
+ * knot_cloud_remove_thing:
+ * @id: thing id
+ *
+ * Stops receiving the data updates and requests of a thing added with
+ * knot_cloud_add_thing(). The other things are not disturbed.
+ *
+ * Returns: 0 if successful and a KNoT error if @id was not added.
+ */
+int knot_cloud_remove_thing(const char *id)
+{
+	if (!id || !l_hashmap_remove(knot_cloud_things, id))
+		return KNOT_ERR_CLOUD_FAILURE;
+
+	if (knot_cloud_routes)
+		unbind_thing(id);
+
+	return 0;
+}
+
 /**
  * knot_cloud_read_start:
  * @id: thing id
- * @read_handler_cb: callback to handle message received from cloud
+ * @read_handler_cb: callback to handle message received from cloud, may be
+ * NULL if every type of interest has its own handler
  * @user_data: user data provided to callbacks
  *
- * Start Cloud to receive messages on read_handler_cb function.
+ * Start Cloud to receive messages on read_handler_cb function, except the
+ * ones routed by knot_cloud_set_handler(). The message is freed once the
+ * callback returns, except for the entries of a CONFIG_MSG list, which the
+ * callback takes over.
  *
  * Returns: 0 if successful and -1 otherwise.
  */
@@ -616,14 +1632,37 @@ int knot_cloud_start(char *url, char *user_token,
 		     knot_cloud_disconnected_cb_t disconnected_cb,
 		     void *user_data)
 {
+	int err;
+
 	log_ell_enable();
 	user_auth_token = l_strdup(user_token);
-	return mq_start(url, connected_cb, disconnected_cb, user_data,
-				 user_auth_token);
+	err = mq_start(url, connected_cb, disconnected_cb, user_data,
+		       user_auth_token);
+	if (err < 0) {
+		l_free(user_auth_token);
+		user_auth_token = NULL;
+	}
+
+	return err;
 }
 
+/**
+ * knot_cloud_stop:
+ *
+ * Stops Cloud and closes the connection. The connection pool, publish
+ * confirms, compression, receive budget, consumer ack, buffer, spool and
+ * backpressure settings are reset as well, so they must be set again
+ * before the next knot_cloud_start().
+ */
 void knot_cloud_stop(void)
 {
+	submit_stop();
+	coalesce_stop();
+	event_stop();
 	destroy_knot_cloud_events();
+	l_hashmap_destroy(knot_cloud_things, NULL);
+	knot_cloud_things = NULL;
 	mq_stop();
+	json_writer_release(&body_writer);
+	parser_stop();
 }
@@ -24,6 +24,60 @@
 #define CLOUD_LOG_PRIORITY_INFO 6
 #define CLOUD_LOG_PRIORITY_DEBUG 7
 
+enum knot_cloud_buffer_policy {
+	KNOT_CLOUD_BUFFER_DROP_OLDEST = 1,
+	KNOT_CLOUD_BUFFER_DROP_NEWEST
+};
+
+struct knot_cloud_buffer_stats {
+	uint32_t len; // messages currently buffered
+	uint64_t buffered;
+	uint64_t dropped;
+	uint64_t replayed;
+};
+
+enum knot_cloud_channel {
+	KNOT_CLOUD_CHANNEL_CONTROL, // device control requests and commands
+	KNOT_CLOUD_CHANNEL_DATA // device data
+};
+
+struct knot_cloud_channel_stats {
+	bool open;
+	bool congested;
+	uint32_t queued; // messages waiting for the socket
+	uint32_t unconfirmed;
+	uint64_t published;
+	uint64_t acked;
+	uint64_t nacked;
+	uint64_t reopened; // times reopened after a channel error
+};
+
+enum knot_cloud_delivery_mode {
+	KNOT_CLOUD_DELIVERY_PERSISTENT, // kept on disk by the cloud
+	KNOT_CLOUD_DELIVERY_TRANSIENT
+};
+
+enum knot_cloud_encoding {
+	KNOT_CLOUD_ENCODING_JSON,
+	KNOT_CLOUD_ENCODING_MSGPACK
+};
+
+enum knot_cloud_publish_type {
+	KNOT_CLOUD_PUBLISH_REGISTER,
+	KNOT_CLOUD_PUBLISH_UNREGISTER,
+	KNOT_CLOUD_PUBLISH_AUTH,
+	KNOT_CLOUD_PUBLISH_CONFIG,
+	KNOT_CLOUD_PUBLISH_LIST,
+	KNOT_CLOUD_PUBLISH_DATA,
+	KNOT_CLOUD_PUBLISH_TYPES_LENGTH
+};
+
+struct knot_cloud_publish_options {
+	uint32_t expiration_ms; // 0 for messages that never expire
+	uint8_t priority; // 0 leaves it unset
+	enum knot_cloud_delivery_mode delivery_mode;
+};
+
 struct knot_cloud_device {
 	char *id;
 	char *uuid;
@@ -33,10 +87,17 @@ struct knot_cloud_device {
 	struct l_timeout *unreg_timeout;
 };
 
+struct knot_cloud_sample {
+	uint8_t sensor_id;
+	uint8_t value_type; // schema value type defined in KNoT protocol
+	knot_value_type value;
+	uint8_t kval_len;
+};
+
 struct knot_cloud_msg {
 	const char *device_id;
 	const char *error;
-	enum {
+	enum knot_cloud_msg_type {
 		UPDATE_MSG,
 		REQUEST_MSG,
 		REGISTER_MSG,
@@ -46,9 +107,10 @@ struct knot_cloud_msg {
 		LIST_MSG,
 		MSG_TYPES_LENGTH
 	} type;
+	/* Token and list share storage, only the one of the type is set */
 	union {
-		char *token; // used when type is REGISTER
-		struct l_queue *list; // used when type is UPDATE/REQUEST/LIST
+		char *token; // REGISTER
+		struct l_queue *list; // UPDATE/REQUEST/CONFIG/LIST
 	};
 };
 
@@ -56,6 +118,9 @@ typedef bool (*knot_cloud_cb_t) (const struct knot_cloud_msg *msg,
 				 void *user_data);
 typedef void (*knot_cloud_connected_cb_t) (void *user_data);
 typedef void (*knot_cloud_disconnected_cb_t) (void *user_data);
+typedef void (*knot_cloud_publish_done_cb_t) (bool acked, void *user_data);
+typedef void (*knot_cloud_backpressure_cb_t) (bool congested,
+					      void *user_data);
 
 int knot_cloud_set_log_priority(int priority);
 int knot_cloud_register_device(const char *id, const char *name);
@@ -66,6 +131,47 @@ int knot_cloud_list_devices(void);
 int knot_cloud_publish_data(const char *id, uint8_t sensor_id,
 			    uint8_t value_type, const knot_value_type *value,
 			    uint8_t kval_len);
+int knot_cloud_publish_data_async(const char *id, uint8_t sensor_id,
+				  uint8_t value_type,
+				  const knot_value_type *value,
+				  uint8_t kval_len,
+				  knot_cloud_publish_done_cb_t done_cb,
+				  void *user_data);
+int knot_cloud_publish_data_batch(const char *id,
+				  const struct knot_cloud_sample *samples,
+				  size_t n);
+int knot_cloud_publish_data_with_options(const char *id,
+			const struct knot_cloud_sample *samples, size_t n,
+			const struct knot_cloud_publish_options *options);
+int knot_cloud_set_publish_options(enum knot_cloud_publish_type type,
+			const struct knot_cloud_publish_options *options);
+int knot_cloud_set_encoding(enum knot_cloud_encoding encoding);
+int knot_cloud_submit_data(const char *id, uint8_t sensor_id,
+			   uint8_t value_type, const knot_value_type *value,
+			   uint8_t kval_len);
+int knot_cloud_set_coalescing(uint32_t window_ms, size_t max_samples);
+int knot_cloud_set_submit_queue(size_t capacity);
+int knot_cloud_set_event_filter(bool enable);
+int knot_cloud_set_device_config(const char *id, struct l_queue *config_list);
+int knot_cloud_set_connection_pool(unsigned int size);
+int knot_cloud_set_publish_confirms(uint32_t window);
+int knot_cloud_set_compression(size_t threshold);
+int knot_cloud_set_receive_budget(uint32_t max_msgs, uint32_t max_ms);
+int knot_cloud_set_consumer_ack(uint16_t prefetch, uint32_t ack_interval_ms);
+int knot_cloud_set_buffer(size_t capacity,
+			  enum knot_cloud_buffer_policy policy,
+			  uint32_t drain_rate);
+void knot_cloud_get_buffer_stats(struct knot_cloud_buffer_stats *stats);
+int knot_cloud_get_channel_stats(enum knot_cloud_channel channel,
+				 struct knot_cloud_channel_stats *stats);
+int knot_cloud_set_spool(const char *path, size_t segment_size);
+int knot_cloud_set_backpressure(size_t high_watermark, size_t low_watermark,
+				knot_cloud_backpressure_cb_t backpressure_cb,
+				void *user_data);
+int knot_cloud_set_handler(enum knot_cloud_msg_type msg_type,
+			   knot_cloud_cb_t handler_cb, void *user_data);
+int knot_cloud_add_thing(const char *id);
+int knot_cloud_remove_thing(const char *id);
 int knot_cloud_read_start(const char *id, knot_cloud_cb_t read_handler_cb,
 			  void *user_data);
 int knot_cloud_start(char *url, char *user_token,
@@ -30,49 +30,257 @@
 #include <stdbool.h>
 #include <sys/time.h>
 #include <errno.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <linux/sockios.h>
 #include <ell/ell.h>
 #include <amqp.h>
 #include <amqp_framing.h>
 #include <amqp_tcp_socket.h>
 
 #include "mq.h"
+#include "outbox.h"
+#include "spool.h"
+#include "compress.h"
 
 #define AMQP_EXCHANGE_TYPE_DIRECT "direct"
 #define AMQP_EXCHANGE_TYPE_FANOUT "fanout"
 
-#define MQ_CONNECTION_CONSUME_TIMEOUT_US 10000
 #define MQ_CONNECTION_CONNECT_TIMEOUT_SEC 10
 #define MQ_CONNECTION_RETRY_TIMEOUT_MS 1000
 
+#define MQ_BACKLOG_DRAIN_INTERVAL_MS 100
+
+/* Messages consumed per readiness event, until either budget runs out */
+#define MQ_RECEIVE_BUDGET_MSGS 64
+#define MQ_RECEIVE_BUDGET_MS 5
+
+/* Pending acks are sent at the latest after this interval */
+#define MQ_ACK_INTERVAL_MS 50
+
+/* Room for the method and header frames sent along with a body */
+#define MQ_FRAME_OVERHEAD 512
+
 #define MQ_NUM_OF_HEADERS 1
 
-struct mq_context {
+#define MQ_CONTENT_TYPE "text/plain"
+#define MQ_EXPIRATION_STR_LEN 21 /* Enough for any uint64_t */
+
+/* Largest decompressed body accepted, guards against compression bombs */
+#define MQ_MAX_INFLATED_LEN (64 * 1024 * 1024)
+
+/* Basic properties shared by every message of a class */
+struct mq_publish_template {
+	const char *exchange_type;
+	mq_channel_class channel;
+	amqp_basic_properties_t props;
+};
+
+/*
+ * State of an AMQP channel. Each traffic class has its own channel, so
+ * confirms, queued writes and broker errors of one class don't hold up
+ * the others.
+ */
+struct mq_channel {
+	amqp_channel_t id;
+	bool open;
+	bool confirms_enabled;
+	uint64_t next_delivery_tag;
+	struct l_queue *pending_confirms;
+	struct l_queue *write_queue;
+	size_t write_queue_len;
+	bool write_congested;
+	uint64_t published;
+	uint64_t acked;
+	uint64_t nacked;
+	uint64_t reopened;
+	uint64_t ack_pending_tag;
+	uint32_t ack_pending_count;
+};
+
+/*
+ * A message being received, assembled frame by frame. Its fields point to
+ * the decoded frames, which are kept by the AMQP library until the message
+ * is delivered. Only a body split over several frames is copied.
+ */
+struct mq_delivery {
+	enum {
+		MQ_DELIVERY_IDLE = 0,
+		MQ_DELIVERY_HEADER,
+		MQ_DELIVERY_BODY
+	} state;
+	amqp_channel_t channel;
+	uint64_t delivery_tag;
+	bool redelivered;
+	amqp_bytes_t exchange;
+	amqp_bytes_t routing_key;
+	amqp_bytes_t content_type;
+	amqp_bytes_t content_encoding;
+	uint8_t *body;
+	size_t body_size;
+	size_t body_received;
+};
+
+/*
+ * A member of the connection pool. Each member connects on its own and
+ * keeps its own channels and buffer of messages published while it is
+ * disconnected, so a member going down doesn't stall the others.
+ */
+struct mq_connection {
+	unsigned int index;
 	amqp_connection_state_t conn;
+	bool connected;
 	struct l_io *amqp_io;
 	struct l_timeout *conn_retry_timeout;
+	struct l_queue *declared_exchanges;
+	struct mq_channel channels[MQ_CHANNEL_COUNT];
+	struct outbox *outbox;
+	struct spool *spool;
+	struct l_timeout *backlog_drain_timeout;
+	struct l_idle *receive_idle;
+	struct mq_delivery delivery;
+	uint64_t delivered;
+	struct l_timeout *ack_timeout;
+	bool consuming;
+	/* Prefetch of the consumer started on it, 0 if it doesn't ack */
+	uint16_t consumer_prefetch;
+	int sndbuf;
+};
+
+struct mq_context {
+	struct mq_publish_template direct_template;
+	struct mq_publish_template rpc_template;
+	struct mq_publish_template fanout_template;
+	char expiration_str[MQ_EXPIRATION_STR_LEN];
+	char *url;
+	struct mq_connection *pool;
+	unsigned int pool_size;
+	unsigned int connected_count;
+	struct mq_connection *consumer;
 	mq_connected_cb_t connected_cb;
 	mq_disconnected_cb_t disconnected_cb;
 	void *connection_data;
 	mq_read_cb_t read_cb;
+	void *read_data;
+	uint32_t confirm_window;
+	size_t outbox_capacity;
+	mq_outbox_policy outbox_policy;
+	uint32_t backlog_drain_rate;
+	char *spool_path;
+	size_t spool_segment_size;
+	size_t write_high_watermark;
+	size_t write_low_watermark;
+	unsigned int write_congested_count;
+	mq_watermark_cb_t watermark_cb;
+	void *watermark_data;
+	size_t compress_threshold;
+	uint32_t receive_budget_msgs;
+	uint32_t receive_budget_ms;
+	uint16_t prefetch_count;
+	uint32_t ack_interval_ms;
+	/* Bumped by mq_stop(), which the read callback may call */
+	unsigned int generation;
+};
+
+struct mq_queued_message {
+	mq_message_data_t message;
+	mq_confirm_cb_t confirm_cb;
+	void *user_data;
+	size_t len;
+	char data[];
+};
+
+struct mq_pending_confirm {
+	uint64_t delivery_tag;
+	mq_confirm_cb_t confirm_cb;
+	void *user_data;
 };
 
-static struct mq_context mq_ctx;
+struct mq_spool_confirm {
+	struct mq_connection *mc;
+	unsigned int seq;
+};
+
+static struct mq_context mq_ctx = {
+	.pool_size = 1,
+	.receive_budget_msgs = MQ_RECEIVE_BUDGET_MSGS,
+	.receive_budget_ms = MQ_RECEIVE_BUDGET_MS,
+	.ack_interval_ms = MQ_ACK_INTERVAL_MS
+};
 static const int8_t num_of_headers = MQ_NUM_OF_HEADERS;
 amqp_table_entry_t headers[MQ_NUM_OF_HEADERS];
 amqp_bytes_t current_queue;
 
-static void on_disconnect(struct l_io *io, void *user_data)
+static void schedule_backlog_drain(struct mq_connection *mc);
+static void requeue_write_queue(struct mq_connection *mc);
+static bool on_writable(struct l_io *io, void *user_data);
+static bool on_receive(struct l_io *io, void *user_data);
+static int start_consumer(struct mq_connection *mc);
+static bool has_buffered_frames(struct mq_connection *mc);
+static void schedule_receive(struct mq_connection *mc);
+
+static struct mq_channel *channel_by_id(struct mq_connection *mc,
+					amqp_channel_t id)
+{
+	if (!id || id > MQ_CHANNEL_COUNT)
+		return NULL;
+
+	return &mc->channels[id - 1];
+}
+
+/*
+ * Members of the pool come and go on their own, while the user is told the
+ * pool is connected only once all of them are.
+ *
+ * Returns true if the pool was fully connected until now.
+ */
+static bool mark_disconnected(struct mq_connection *mc)
+{
+	if (!mc->connected)
+		return false;
+
+	mc->connected = false;
+
+	return mq_ctx.connected_count-- == mq_ctx.pool_size;
+}
+
+static void mark_connected(struct mq_connection *mc)
+{
+	mc->connected = true;
+
+	if (++mq_ctx.connected_count == mq_ctx.pool_size &&
+	    mq_ctx.connected_cb)
+		mq_ctx.connected_cb(mq_ctx.connection_data);
+}
+
+/*
+ * Takes the member out of the pool until the retry timeout connects it
+ * again, which starts over with new channels.
+ */
+static void schedule_reconnect(struct mq_connection *mc)
 {
-	l_debug("AMQP broker disconnected");
+	bool was_connected;
+
+	was_connected = mark_disconnected(mc);
+	requeue_write_queue(mc);
 
-	if (mq_ctx.disconnected_cb)
+	if (was_connected && mq_ctx.disconnected_cb)
 		mq_ctx.disconnected_cb(mq_ctx.connection_data);
 
-	if (mq_ctx.conn_retry_timeout)
-		l_timeout_modify_ms(mq_ctx.conn_retry_timeout,
+	if (mc->conn_retry_timeout)
+		l_timeout_modify_ms(mc->conn_retry_timeout,
 				    MQ_CONNECTION_RETRY_TIMEOUT_MS);
 }
 
+static void on_disconnect(struct l_io *io, void *user_data)
+{
+	struct mq_connection *mc = user_data;
+
+	l_debug("AMQP broker disconnected on connection %u", mc->index);
+
+	schedule_reconnect(mc);
+}
+
 static const char *mq_server_exception_string(amqp_rpc_reply_t reply)
 {
 	amqp_connection_close_t *m = reply.reply.decoded;
@@ -116,51 +324,410 @@ static const char *mq_rpc_reply_string(amqp_rpc_reply_t reply)
 	}
 }
 
-static void close_connection(void)
+static void complete_pending_confirm(struct mq_pending_confirm *pending,
+				     bool acked)
+{
+	if (pending->confirm_cb)
+		pending->confirm_cb(acked, pending->user_data);
+
+	l_free(pending);
+}
+
+/* Counts each message the broker settles, one frame may settle several */
+static void settle_pending_confirm(struct mq_channel *channel,
+				   struct mq_pending_confirm *pending,
+				   bool acked)
+{
+	if (acked)
+		channel->acked++;
+	else
+		channel->nacked++;
+
+	complete_pending_confirm(pending, acked);
+}
+
+static bool pending_confirm_tag_cmp(const void *data, const void *user_data)
+{
+	const struct mq_pending_confirm *pending = data;
+	const uint64_t *delivery_tag = user_data;
+
+	return pending->delivery_tag == *delivery_tag;
+}
+
+/**
+ * Handles a basic.ack or basic.nack received from the broker. With the
+ * multiple flag set, every outstanding message up to and including
+ * @delivery_tag is settled. Tag zero with multiple set settles all of them.
+ */
+static void on_confirm(struct mq_channel *channel, uint64_t delivery_tag,
+		       bool multiple, bool acked)
+{
+	struct mq_pending_confirm *pending;
+
+	if (!multiple) {
+		pending = l_queue_remove_if(channel->pending_confirms,
+					    pending_confirm_tag_cmp,
+					    &delivery_tag);
+		if (!pending) {
+			l_debug("Unknown delivery tag %"PRIu64, delivery_tag);
+			return;
+		}
+
+		settle_pending_confirm(channel, pending, acked);
+		return;
+	}
+
+	/* Outstanding confirms are kept ordered by delivery tag */
+	while ((pending = l_queue_peek_head(channel->pending_confirms))) {
+		if (delivery_tag && pending->delivery_tag > delivery_tag)
+			break;
+
+		l_queue_pop_head(channel->pending_confirms);
+		settle_pending_confirm(channel, pending, acked);
+	}
+}
+
+static void fail_pending_confirms(struct mq_channel *channel)
+{
+	struct l_queue *pending_confirms = channel->pending_confirms;
+	struct mq_pending_confirm *pending;
+
+	channel->confirms_enabled = false;
+
+	if (l_queue_isempty(pending_confirms))
+		return;
+
+	/* Callbacks may publish again, so settle on a detached list */
+	channel->pending_confirms = l_queue_new();
+
+	while ((pending = l_queue_pop_head(pending_confirms)))
+		complete_pending_confirm(pending, false);
+
+	l_queue_destroy(pending_confirms, NULL);
+}
+
+/*
+ * Waits for the reply of a synchronous method. rabbitmq-c keeps the frames
+ * that arrive before the reply, deliveries included, and the socket won't
+ * be readable for them again, so they are consumed on the next iteration.
+ */
+static amqp_rpc_reply_t wait_rpc_reply(struct mq_connection *mc)
+{
+	amqp_rpc_reply_t r = amqp_get_rpc_reply(mc->conn);
+
+	if (has_buffered_frames(mc))
+		schedule_receive(mc);
+
+	return r;
+}
+
+static int open_channel(struct mq_connection *mc,
+			struct mq_channel *channel)
+{
+	amqp_rpc_reply_t r;
+
+	amqp_channel_open(mc->conn, channel->id);
+	r = wait_rpc_reply(mc);
+	if (r.reply_type != AMQP_RESPONSE_NORMAL) {
+		l_error("amqp_channel_open(): %s",
+			mq_rpc_reply_string(r));
+		return -1;
+	}
+
+	channel->open = true;
+
+	if (!mq_ctx.confirm_window)
+		return 0;
+
+	amqp_confirm_select(mc->conn, channel->id);
+	r = wait_rpc_reply(mc);
+	if (r.reply_type != AMQP_RESPONSE_NORMAL) {
+		l_error("amqp_confirm_select(): %s",
+			mq_rpc_reply_string(r));
+		return -1;
+	}
+
+	/* Delivery tags are counted per channel starting at 1 */
+	channel->next_delivery_tag = 1;
+	channel->confirms_enabled = true;
+
+	return 0;
+}
+
+static void close_channels(struct mq_connection *mc)
 {
 	amqp_rpc_reply_t r;
+	int i;
+
+	for (i = 0; i < MQ_CHANNEL_COUNT; i++) {
+		if (!mc->channels[i].open)
+			continue;
+
+		mc->channels[i].open = false;
+
+		r = amqp_channel_close(mc->conn, mc->channels[i].id,
+				       AMQP_REPLY_SUCCESS);
+		if (r.reply_type != AMQP_RESPONSE_NORMAL)
+			l_error("amqp_channel_close: %s",
+					mq_rpc_reply_string(r));
+	}
+}
+
+/*
+ * A channel error closes only the channel where it happened. The broker
+ * waits for close-ok before the channel can be opened again, leaving the
+ * other channels and the connection untouched. The consumer goes away with
+ * its channel, so it is started again on the new one. If any of it fails,
+ * the whole member is connected again.
+ */
+static void reopen_channel(struct mq_connection *mc,
+			   struct mq_channel *channel,
+			   const amqp_channel_close_t *close)
+{
+	amqp_channel_close_ok_t close_ok;
 	int err;
 
-	if (!mq_ctx.conn)
+	l_error("Channel %u of connection %u closed by broker: %u %.*s",
+		channel->id, mc->index, close->reply_code,
+		(int) close->reply_text.len,
+		(char *) close->reply_text.bytes);
+
+	channel->open = false;
+
+	err = amqp_send_method(mc->conn, channel->id,
+			       AMQP_CHANNEL_CLOSE_OK_METHOD, &close_ok);
+	if (err < 0) {
+		l_error("amqp_send_method(): %s", amqp_error_string2(err));
+		schedule_reconnect(mc);
 		return;
+	}
 
-	r = amqp_channel_close(mq_ctx.conn, 1, AMQP_REPLY_SUCCESS);
-	if (r.reply_type != AMQP_RESPONSE_NORMAL)
-		l_error("amqp_channel_close: %s",
-				mq_rpc_reply_string(r));
+	/* Messages not confirmed so far are lost with the channel */
+	fail_pending_confirms(channel);
+
+	/* The broker requeues the deliveries not acked on the channel */
+	channel->ack_pending_count = 0;
+
+	if (open_channel(mc, channel) < 0) {
+		schedule_reconnect(mc);
+		return;
+	}
+
+	channel->reopened++;
+
+	/* Cleared first, so a consumer failing again isn't retried forever */
+	if (channel == &mc->channels[MQ_CHANNEL_CONTROL] && mc->consuming) {
+		mc->consuming = false;
+		if (start_consumer(mc) < 0) {
+			schedule_reconnect(mc);
+			return;
+		}
+	}
+
+	if (!l_queue_isempty(channel->write_queue))
+		l_io_set_write_handler(mc->amqp_io, on_writable, mc, NULL);
+}
+
+/*
+ * Gets the reply of a synchronous method, opening the channel again if the
+ * broker closed it because of the method.
+ */
+static amqp_rpc_reply_t get_rpc_reply(struct mq_connection *mc,
+				      struct mq_channel *channel)
+{
+	amqp_rpc_reply_t r = wait_rpc_reply(mc);
+
+	if (r.reply_type == AMQP_RESPONSE_SERVER_EXCEPTION &&
+	    r.reply.id == AMQP_CHANNEL_CLOSE_METHOD)
+		reopen_channel(mc, channel, r.reply.decoded);
+
+	return r;
+}
+
+static void delivery_reset(struct mq_delivery *delivery)
+{
+	l_free(delivery->body);
+	memset(delivery, 0, sizeof(*delivery));
+}
+
+/*
+ * Acknowledges at once every delivery handled so far on each channel,
+ * through the multiple flag of basic.ack.
+ */
+static void flush_acks(struct mq_connection *mc)
+{
+	struct mq_channel *channel;
+	int err;
+	int i;
+
+	l_timeout_remove(mc->ack_timeout);
+	mc->ack_timeout = NULL;
+
+	for (i = 0; i < MQ_CHANNEL_COUNT; i++) {
+		channel = &mc->channels[i];
+		if (!channel->ack_pending_count)
+			continue;
+
+		channel->ack_pending_count = 0;
+
+		if (!mc->conn || !channel->open)
+			continue;
+
+		err = amqp_basic_ack(mc->conn, channel->id,
+				     channel->ack_pending_tag,
+				     1); /* multiple */
+		if (err < 0)
+			l_error("amqp_basic_ack(): %s",
+				amqp_error_string2(err));
+	}
+}
+
+static void on_ack_timeout(struct l_timeout *timeout, void *user_data)
+{
+	struct mq_connection *mc = user_data;
+
+	flush_acks(mc);
+}
+
+/*
+ * Acks are held until half of the prefetch window is handled or the ack
+ * interval expires, whatever happens first, so the broker keeps pushing
+ * without an ack frame per message.
+ */
+static void ack_delivery(struct mq_connection *mc, amqp_channel_t id,
+			 uint64_t delivery_tag)
+{
+	struct mq_channel *channel = channel_by_id(mc, id);
+
+	if (!channel)
+		return;
+
+	channel->ack_pending_tag = delivery_tag;
+	channel->ack_pending_count++;
+
+	if (!mq_ctx.ack_interval_ms ||
+	    channel->ack_pending_count >= (mc->consumer_prefetch + 1u) / 2) {
+		flush_acks(mc);
+		return;
+	}
+
+	if (!mc->ack_timeout)
+		mc->ack_timeout = l_timeout_create_ms(mq_ctx.ack_interval_ms,
+						      on_ack_timeout, mc,
+						      NULL);
+}
+
+/*
+ * Gives a delivery back to the broker, which puts it on the queue again
+ * if @requeue is set or discards it otherwise.
+ */
+static void reject_delivery(struct mq_connection *mc, amqp_channel_t id,
+			    uint64_t delivery_tag, bool requeue)
+{
+	struct mq_channel *channel = channel_by_id(mc, id);
+	int err;
+
+	if (!channel || !channel->open)
+		return;
+
+	/* Keep the acks in order with the rejected delivery */
+	flush_acks(mc);
+
+	err = amqp_basic_nack(mc->conn, channel->id, delivery_tag,
+			      0, /* multiple */
+			      requeue);
+	if (err < 0)
+		l_error("amqp_basic_nack(): %s", amqp_error_string2(err));
+}
+
+/*
+ * Settles a delivery, unless the consumer runs without acknowledgements.
+ * A failed delivery is requeued only if it wasn't redelivered, so a
+ * message the application never takes doesn't loop forever. The broker
+ * also flags the messages left unacked by a dropped connection as
+ * redelivered, so those are discarded on their first failure.
+ */
+static void settle_delivery(struct mq_connection *mc,
+			    const struct mq_delivery *delivery,
+			    bool success, bool requeue)
+{
+	if (!mc->consumer_prefetch)
+		return;
+
+	if (success)
+		ack_delivery(mc, delivery->channel, delivery->delivery_tag);
+	else
+		reject_delivery(mc, delivery->channel, delivery->delivery_tag,
+				requeue && !delivery->redelivered);
+}
+
+static void close_connection(struct mq_connection *mc)
+{
+	amqp_rpc_reply_t r;
+	int err;
+	int i;
+
+	/* Messages not confirmed so far are lost with the connection */
+	for (i = 0; i < MQ_CHANNEL_COUNT; i++)
+		fail_pending_confirms(&mc->channels[i]);
+
+	mark_disconnected(mc);
+	requeue_write_queue(mc);
+
+	l_timeout_remove(mc->backlog_drain_timeout);
+	mc->backlog_drain_timeout = NULL;
 
-	r = amqp_connection_close(mq_ctx.conn, AMQP_REPLY_SUCCESS);
+	l_idle_remove(mc->receive_idle);
+	mc->receive_idle = NULL;
+
+	delivery_reset(&mc->delivery);
+
+	/* Spare the broker redelivering the messages already handled */
+	flush_acks(mc);
+	mc->consumer_prefetch = 0;
+	mc->consuming = false;
+
+	if (!mc->conn)
+		return;
+
+	close_channels(mc);
+
+	r = amqp_connection_close(mc->conn, AMQP_REPLY_SUCCESS);
 	if (r.reply_type != AMQP_RESPONSE_NORMAL)
 		l_error("amqp_connection_close: %s",
 				mq_rpc_reply_string(r));
 
-	err = amqp_destroy_connection(mq_ctx.conn);
+	err = amqp_destroy_connection(mc->conn);
 	if (err < 0)
 		l_error("amqp_destroy_connection: %s",
 				amqp_error_string2(err));
 
-	mq_ctx.conn = NULL;
+	mc->conn = NULL;
 }
 
 static void attempt_connection(struct l_timeout *ltimeout, void *user_data)
 {
-	const char *url = user_data;
+	struct mq_connection *mc = user_data;
 	amqp_socket_t *socket;
 	struct amqp_connection_info cinfo;
-	char *tmp_url = l_strdup(url);
+	char *tmp_url = l_strdup(mq_ctx.url);
 	amqp_rpc_reply_t r;
 	struct timeval timeout = {.tv_sec = MQ_CONNECTION_CONNECT_TIMEOUT_SEC};
 	int status;
+	int i;
 
-	l_debug("Trying to connect to rabbitmq");
+	l_debug("Trying to connect to rabbitmq on connection %u", mc->index);
 
 	/* Check and close if a connection is already up */
-	close_connection();
+	close_connection(mc);
+
+	/* Exchanges must be declared again on the new connection */
+	l_queue_clear(mc->declared_exchanges, l_free);
 
 	/* Check and destroy if an IO is already allocated */
-	if (mq_ctx.amqp_io) {
-		l_io_destroy(mq_ctx.amqp_io);
-		mq_ctx.amqp_io = NULL;
+	if (mc->amqp_io) {
+		l_io_destroy(mc->amqp_io);
+		mc->amqp_io = NULL;
 	}
 
 	// This function will change the url after processed
@@ -170,13 +737,13 @@ static void attempt_connection(struct l_timeout *ltimeout, void *user_data)
 		goto done;
 	}
 
-	mq_ctx.conn = amqp_new_connection();
-	if (!mq_ctx.conn) {
+	mc->conn = amqp_new_connection();
+	if (!mc->conn) {
 		l_error("amqp_new_connection: Error on creation");
 		goto done;
 	}
 
-	socket = amqp_tcp_socket_new(mq_ctx.conn);
+	socket = amqp_tcp_socket_new(mc->conn);
 	if (!socket) {
 		l_error("error creating tcp socket");
 		goto destroy_conn;
@@ -190,7 +757,7 @@ static void attempt_connection(struct l_timeout *ltimeout, void *user_data)
 		goto close_conn;
 	}
 
-	r = amqp_login(mq_ctx.conn, cinfo.vhost,
+	r = amqp_login(mc->conn, cinfo.vhost,
 		       AMQP_DEFAULT_MAX_CHANNELS, AMQP_DEFAULT_FRAME_SIZE,
 		       AMQP_DEFAULT_HEARTBEAT, AMQP_SASL_METHOD_PLAIN,
 		       cinfo.user, cinfo.password);
@@ -199,288 +766,1519 @@ static void attempt_connection(struct l_timeout *ltimeout, void *user_data)
 		goto close_conn;
 	}
 
-	amqp_channel_open(mq_ctx.conn, 1);
-	r = amqp_get_rpc_reply(mq_ctx.conn);
-	if (r.reply_type != AMQP_RESPONSE_NORMAL) {
-		l_error("amqp_channel_open(): %s",
-			mq_rpc_reply_string(r));
-		goto close_conn;
-	}
+	for (i = 0; i < MQ_CHANNEL_COUNT; i++)
+		if (open_channel(mc, &mc->channels[i]) < 0)
+			goto close_channel;
 
-	mq_ctx.amqp_io = l_io_new(amqp_get_sockfd(mq_ctx.conn));
-	if (!mq_ctx.amqp_io)
+	mc->amqp_io = l_io_new(amqp_get_sockfd(mc->conn));
+	if (!mc->amqp_io)
 		goto close_channel;
 
-	status = l_io_set_disconnect_handler(mq_ctx.amqp_io, on_disconnect,
-					     NULL, NULL);
+	status = l_io_set_disconnect_handler(mc->amqp_io, on_disconnect,
+					     mc, NULL);
 	if (!status) {
 		l_error("Error on set up disconnect handler");
 		goto io_destroy;
 	}
 
-	if (mq_ctx.connected_cb)
-		mq_ctx.connected_cb(mq_ctx.connection_data);
+	if (getsockopt(amqp_get_sockfd(mc->conn), SOL_SOCKET, SO_SNDBUF,
+		       &mc->sndbuf, &(socklen_t) { sizeof(mc->sndbuf) }) < 0)
+		mc->sndbuf = 0;
+
+	/* Publisher confirms are read along with the deliveries */
+	if (mq_ctx.read_cb)
+		l_io_set_read_handler(mc->amqp_io, on_receive, mc, NULL);
+
+	mark_connected(mc);
+
+	/* Replay what was published while the broker was unreachable */
+	schedule_backlog_drain(mc);
 
 	goto done;
 
 io_destroy:
-	l_io_destroy(mq_ctx.amqp_io);
-	mq_ctx.amqp_io = NULL;
+	l_io_destroy(mc->amqp_io);
+	mc->amqp_io = NULL;
 close_channel:
-	r = amqp_channel_close(mq_ctx.conn, 1, AMQP_REPLY_SUCCESS);
-	if (r.reply_type != AMQP_RESPONSE_NORMAL)
-		l_error("amqp_channel_close: %s",
-				mq_rpc_reply_string(r));
+	for (i = 0; i < MQ_CHANNEL_COUNT; i++)
+		mc->channels[i].confirms_enabled = false;
+
+	close_channels(mc);
 close_conn:
-	r = amqp_connection_close(mq_ctx.conn, AMQP_REPLY_SUCCESS);
+	r = amqp_connection_close(mc->conn, AMQP_REPLY_SUCCESS);
 	if (r.reply_type != AMQP_RESPONSE_NORMAL)
 		l_error("amqp_connection_close: %s",
 			mq_rpc_reply_string(r));
 destroy_conn:
-	status = amqp_destroy_connection(mq_ctx.conn);
+	status = amqp_destroy_connection(mc->conn);
 	if (status < 0)
 		l_error("status destroy: %s", amqp_error_string2(status));
 
-	mq_ctx.conn = NULL;
+	mc->conn = NULL;
 	l_timeout_modify_ms(ltimeout, MQ_CONNECTION_RETRY_TIMEOUT_MS);
 done:
 	l_free(tmp_url);
 }
 
-static char *mq_bytes_to_new_string(amqp_bytes_t data)
+static mq_view_t mq_bytes_to_view(amqp_bytes_t data)
 {
-	char *str = l_new(char, data.len + 1);
+	mq_view_t view = { .ptr = data.bytes, .len = data.len };
 
-	memcpy(str, data.bytes, data.len);
-	str[data.len] = '\0';
-	return str;
+	return view;
 }
 
-/**
- * Callback function to consume message envelope from AMQP queue.
+static bool mq_view_equal(mq_view_t view, const char *str)
+{
+	return view.len == strlen(str) && !memcmp(view.ptr, str, view.len);
+}
+
+/*
+ * Points @message body to the body of a received message, decompressing
+ * it if needed into a buffer returned to be freed by the caller.
  *
- * Returns true on success or false if the read callback is not set.
+ * Returns false if the body encoding isn't supported.
  */
-static bool on_receive(struct l_io *io, void *user_data)
+static bool decode_body(mq_received_message_t *message,
+			const struct mq_delivery *delivery,
+			const uint8_t *body, char **inflated)
 {
-	amqp_rpc_reply_t res;
-	amqp_envelope_t envelope;
-	char *exchange, *routing_key, *body;
-	struct timeval time_out = {.tv_usec = MQ_CONNECTION_CONSUME_TIMEOUT_US};
-	bool success;
-
-	if (amqp_release_buffers_ok(mq_ctx.conn))
-		amqp_release_buffers(mq_ctx.conn);
+	mq_view_t encoding = mq_bytes_to_view(delivery->content_encoding);
+	size_t len;
+	int err;
 
-	res = amqp_consume_message(mq_ctx.conn, &envelope, &time_out, 0);
+	*inflated = NULL;
+	message->body.ptr = body;
+	message->body.len = delivery->body_size;
 
-	if (res.reply_type != AMQP_RESPONSE_NORMAL)
+	if (!encoding.len)
 		return true;
 
-	l_debug("Receive %u -> exchange: %.*s, routingkey: %.*s\nBody: %.*s\n",
-		(unsigned int)envelope.delivery_tag,
-		(int)envelope.exchange.len,
-		(char *)envelope.exchange.bytes,
-		(int)envelope.routing_key.len,
-		(char *)envelope.routing_key.bytes,
-		(int)envelope.message.body.len,
-		(char *)envelope.message.body.bytes);
+	if (!mq_view_equal(encoding, COMPRESS_ENCODING_DEFLATE)) {
+		l_error("Unsupported content encoding %.*s",
+			(int) encoding.len, (const char *) encoding.ptr);
+		return false;
+	}
+
+	err = compress_inflate(body, delivery->body_size, MQ_MAX_INFLATED_LEN,
+			       inflated, &len);
+	if (err < 0) {
+		l_error("Failed to decompress body: %s", strerror(-err));
+		return false;
+	}
+
+	message->body.ptr = (const uint8_t *) *inflated;
+	message->body.len = len;
+
+	return true;
+}
+
+/*
+ * Hands a fully received message over to the read callback, without
+ * copying it. @body is valid until the next frame is read.
+ *
+ * Returns 0 if successful, -ENOENT if the read callback is not set and
+ * -ECANCELED if the read callback stopped the connections.
+ */
+static int deliver_message(struct mq_connection *mc, const uint8_t *body)
+{
+	struct mq_delivery *delivery = &mc->delivery;
+	mq_received_message_t message = {
+		.exchange = mq_bytes_to_view(delivery->exchange),
+		.routing_key = mq_bytes_to_view(delivery->routing_key),
+		.content_type = mq_bytes_to_view(delivery->content_type)
+	};
+	unsigned int generation = mq_ctx.generation;
+	char *inflated;
+	bool success;
+
+	l_debug("Receive %u -> exchange: %.*s, routingkey: %.*s\n"
+		"Body: %zu bytes\n",
+		(unsigned int)delivery->delivery_tag,
+		(int)message.exchange.len,
+		(const char *)message.exchange.ptr,
+		(int)message.routing_key.len,
+		(const char *)message.routing_key.ptr,
+		delivery->body_size);
 
 	if (!mq_ctx.read_cb) {
 		l_debug("AMQP read callback is not set");
-		amqp_destroy_envelope(&envelope);
-		return false;
+		settle_delivery(mc, delivery, false, true);
+		delivery_reset(delivery);
+		return -ENOENT;
 	}
 
-	exchange = mq_bytes_to_new_string(envelope.exchange);
-	routing_key = mq_bytes_to_new_string(envelope.routing_key);
-	body = mq_bytes_to_new_string(envelope.message.body);
+	if (!decode_body(&message, delivery, body, &inflated)) {
+		/* The message is consumed, but not used */
+		settle_delivery(mc, delivery, false, false);
+		delivery_reset(delivery);
+		return 0;
+	}
+
+	success = mq_ctx.read_cb(&message, mq_ctx.read_data);
+	l_free(inflated);
+
+	/* Stopped from the callback, the connection is gone */
+	if (mq_ctx.generation != generation)
+		return -ECANCELED;
 
-	success = mq_ctx.read_cb(exchange, routing_key, body, user_data);
 	if (!success)
-		/* TODO: Add the msg on the queue again */
 		l_debug("Message envelope not consumed");
 
-	l_debug("Destroy received envelope");
-	amqp_destroy_envelope(&envelope);
-	l_free(exchange);
-	l_free(routing_key);
-	l_free(body);
+	/* Messages not consumed are put on the queue again, once */
+	settle_delivery(mc, delivery, success, true);
 
-	return true;
+	delivery_reset(delivery);
+	mc->delivered++;
+
+	return 0;
 }
 
-static int mq_prepare_queue(const char *exchange, const char *exchange_type,
-		 const char *routing_key)
+static void on_deliver(struct mq_connection *mc, amqp_channel_t channel,
+		       const amqp_basic_deliver_t *deliver)
 {
-	if (exchange == NULL || exchange_type == NULL || routing_key == NULL)
-		return -1;
+	struct mq_delivery *delivery = &mc->delivery;
 
-	/* Declare the exchange as durable */
-	amqp_exchange_declare(mq_ctx.conn, 1,
-			amqp_cstring_bytes(exchange),
-			amqp_cstring_bytes(exchange_type),
-			0 /* passive*/,
-			1 /* durable */,
-			0 /* auto_delete*/,
+	if (delivery->state != MQ_DELIVERY_IDLE) {
+		l_error("Incomplete message %u dropped",
+			(unsigned int)delivery->delivery_tag);
+		settle_delivery(mc, delivery, false, true);
+		delivery_reset(delivery);
+	}
+
+	delivery->state = MQ_DELIVERY_HEADER;
+	delivery->channel = channel;
+	delivery->delivery_tag = deliver->delivery_tag;
+	delivery->exchange = deliver->exchange;
+	delivery->routing_key = deliver->routing_key;
+	delivery->redelivered = deliver->redelivered;
+}
+
+static int on_header(struct mq_connection *mc, const amqp_frame_t *frame)
+{
+	struct mq_delivery *delivery = &mc->delivery;
+	const amqp_basic_properties_t *props =
+					frame->payload.properties.decoded;
+
+	if (delivery->state != MQ_DELIVERY_HEADER ||
+	    delivery->channel != frame->channel) {
+		l_debug("Unexpected header on channel %u", frame->channel);
+		return 0;
+	}
+
+	if (props->_flags & AMQP_BASIC_CONTENT_TYPE_FLAG)
+		delivery->content_type = props->content_type;
+	if (props->_flags & AMQP_BASIC_CONTENT_ENCODING_FLAG)
+		delivery->content_encoding = props->content_encoding;
+
+	delivery->state = MQ_DELIVERY_BODY;
+	delivery->body_size = frame->payload.properties.body_size;
+
+	return delivery->body_size ? 0 : deliver_message(mc, NULL);
+}
+
+static int on_body(struct mq_connection *mc, const amqp_frame_t *frame)
+{
+	struct mq_delivery *delivery = &mc->delivery;
+	const amqp_bytes_t *fragment = &frame->payload.body_fragment;
+
+	if (delivery->state != MQ_DELIVERY_BODY ||
+	    delivery->channel != frame->channel) {
+		l_debug("Unexpected body on channel %u", frame->channel);
+		return 0;
+	}
+
+	if (fragment->len > delivery->body_size - delivery->body_received) {
+		l_error("Message %u body overflow, dropped",
+			(unsigned int)delivery->delivery_tag);
+		settle_delivery(mc, delivery, false, false);
+		delivery_reset(delivery);
+		return 0;
+	}
+
+	/* A body in a single frame is delivered straight from it */
+	if (fragment->len == delivery->body_size)
+		return deliver_message(mc, fragment->bytes);
+
+	/* The frame buffer is reused by the next read, keep a copy */
+	if (!delivery->body)
+		delivery->body = l_malloc(delivery->body_size);
+
+	memcpy(delivery->body + delivery->body_received, fragment->bytes,
+	       fragment->len);
+	delivery->body_received += fragment->len;
+
+	if (delivery->body_received < delivery->body_size)
+		return 0;
+
+	return deliver_message(mc, delivery->body);
+}
+
+/*
+ * A write queue stalled on a full confirm window goes on once confirms
+ * make room, unless a confirm callback stopped everything.
+ */
+static void resume_write_queue(struct mq_connection *mc,
+			       struct mq_channel *channel,
+			       unsigned int generation)
+{
+	if (generation != mq_ctx.generation || !mc->amqp_io ||
+	    l_queue_isempty(channel->write_queue))
+		return;
+
+	l_io_set_write_handler(mc->amqp_io, on_writable, mc, NULL);
+}
+
+static void on_method(struct mq_connection *mc, const amqp_frame_t *frame)
+{
+	unsigned int generation = mq_ctx.generation;
+	amqp_basic_ack_t *ack;
+	amqp_basic_nack_t *nack;
+	struct mq_channel *channel;
+
+	channel = channel_by_id(mc, frame->channel);
+	if (!channel) {
+		l_debug("Method on unknown channel %u", frame->channel);
+		return;
+	}
+
+	switch (frame->payload.method.id) {
+	case AMQP_BASIC_DELIVER_METHOD:
+		on_deliver(mc, frame->channel, frame->payload.method.decoded);
+		break;
+	case AMQP_BASIC_ACK_METHOD:
+		ack = frame->payload.method.decoded;
+		on_confirm(channel, ack->delivery_tag, ack->multiple, true);
+		resume_write_queue(mc, channel, generation);
+		break;
+	case AMQP_BASIC_NACK_METHOD:
+		nack = frame->payload.method.decoded;
+		on_confirm(channel, nack->delivery_tag, nack->multiple, false);
+		resume_write_queue(mc, channel, generation);
+		break;
+	case AMQP_CHANNEL_CLOSE_METHOD:
+		if (mc->delivery.state != MQ_DELIVERY_IDLE &&
+		    mc->delivery.channel == frame->channel)
+			delivery_reset(&mc->delivery);
+		reopen_channel(mc, channel, frame->payload.method.decoded);
+		break;
+	default:
+		l_debug("Unexpected method 0x%08X",
+			frame->payload.method.id);
+		break;
+	}
+}
+
+/*
+ * Handles the next frame only if it was already received, deliveries are
+ * assembled across calls from their method, header and body frames. It
+ * never waits for the socket, a partial frame is kept by the AMQP library
+ * until the rest of it arrives.
+ *
+ * Returns 1 if a frame was handled, 0 if there is none available yet and
+ * a negative errno if the read callback is not set.
+ */
+static int consume_frame(struct mq_connection *mc)
+{
+	struct timeval no_wait = { 0 };
+	amqp_frame_t frame;
+	int status;
+	int err = 0;
+
+	/* The message being received still points to the buffers */
+	if (mc->delivery.state == MQ_DELIVERY_IDLE &&
+	    amqp_release_buffers_ok(mc->conn))
+		amqp_release_buffers(mc->conn);
+
+	status = amqp_simple_wait_frame_noblock(mc->conn, &frame, &no_wait);
+	if (status == AMQP_STATUS_TIMEOUT)
+		return 0;
+
+	if (status != AMQP_STATUS_OK) {
+		l_error("amqp_simple_wait_frame_noblock(): %s",
+			amqp_error_string2(status));
+		return 0;
+	}
+
+	switch (frame.frame_type) {
+	case AMQP_FRAME_METHOD:
+		on_method(mc, &frame);
+		break;
+	case AMQP_FRAME_HEADER:
+		err = on_header(mc, &frame);
+		break;
+	case AMQP_FRAME_BODY:
+		err = on_body(mc, &frame);
+		break;
+	default:
+		break;
+	}
+
+	return err < 0 ? err : 1;
+}
+
+/*
+ * rabbitmq-c reads from the socket as much as it can, so the frames of
+ * several messages may already be buffered when the socket is readable.
+ * They are consumed right away, as the socket won't wake the loop up for
+ * them, within a budget that keeps other sources of the loop served.
+ */
+static bool has_buffered_frames(struct mq_connection *mc)
+{
+	return amqp_frames_enqueued(mc->conn) || amqp_data_in_buffer(mc->conn);
+}
+
+static void on_receive_idle(struct l_idle *idle, void *user_data)
+{
+	struct mq_connection *mc = user_data;
+
+	l_idle_remove(mc->receive_idle);
+	mc->receive_idle = NULL;
+
+	if (mc->connected)
+		on_receive(mc->amqp_io, mc);
+}
+
+static void schedule_receive(struct mq_connection *mc)
+{
+	if (mc->receive_idle)
+		return;
+
+	mc->receive_idle = l_idle_create(on_receive_idle, mc, NULL);
+}
+
+/**
+ * Callback function to consume the frames available from AMQP queue. It
+ * returns as soon as there is nothing left to read without blocking.
+ * Nothing of @user_data is touched once the read callback stopped the
+ * connections.
+ *
+ * Returns true on success or false if the read callback is not set.
+ */
+static bool on_receive(struct l_io *io, void *user_data)
+{
+	struct mq_connection *mc = user_data;
+	unsigned int generation = mq_ctx.generation;
+	uint64_t delivered = mc->delivered;
+	uint64_t deadline;
+	int res;
+
+	deadline = l_time_offset(l_time_now(),
+				 mq_ctx.receive_budget_ms * L_USEC_PER_MSEC);
+
+	do {
+		res = consume_frame(mc);
+		if (mq_ctx.generation != generation)
+			return true;
+		if (res < 0)
+			return false;
+		if (!res)
+			break;
+	} while (mc->delivered - delivered < mq_ctx.receive_budget_msgs &&
+		 l_time_before(l_time_now(), deadline));
+
+	/* Budget exhausted, come back for the rest on the next iteration */
+	if (res > 0 && has_buffered_frames(mc))
+		schedule_receive(mc);
+
+	return true;
+}
+
+static bool exchange_name_cmp(const void *a, const void *b)
+{
+	const char *name1 = a;
+	const char *name2 = b;
+
+	return !strcmp(name1, name2);
+}
+
+/**
+ * Declares the exchange as durable only once per connection. Declared
+ * exchanges are cached until the connection is reestablished, saving a
+ * synchronous broker round trip on every publish.
+ *
+ * Returns 0 on success or -1 otherwise.
+ */
+static int mq_declare_exchange(struct mq_connection *mc, const char *exchange,
+			       const char *type)
+{
+	struct mq_channel *channel = &mc->channels[MQ_CHANNEL_CONTROL];
+	amqp_rpc_reply_t resp;
+
+	if (l_queue_find(mc->declared_exchanges, exchange_name_cmp,
+			 exchange))
+		return 0;
+
+	amqp_exchange_declare(mc->conn, channel->id,
+			amqp_cstring_bytes(exchange),
+			amqp_cstring_bytes(type),
+			0 /* passive*/,
+			1 /* durable */,
+			0 /* auto_delete*/,
 			0 /* internal */,
 			amqp_empty_table);
+	resp = get_rpc_reply(mc, channel);
+	if (resp.reply_type != AMQP_RESPONSE_NORMAL) {
+		l_error("amqp_exchange_declare(): %s",
+			mq_rpc_reply_string(resp));
+		return -1;
+	}
+
+	l_queue_push_tail(mc->declared_exchanges, l_strdup(exchange));
+
+	return 0;
+}
+
+static int mq_prepare_queue(struct mq_connection *mc, const char *exchange,
+			    const char *exchange_type, const char *routing_key)
+{
+	struct mq_channel *channel = &mc->channels[MQ_CHANNEL_CONTROL];
+
+	if (exchange == NULL || exchange_type == NULL || routing_key == NULL)
+		return -1;
+
+	if (mq_declare_exchange(mc, exchange, exchange_type) < 0)
+		return -1;
+
+	/* Set up to bind a queue to an exchange */
+	amqp_queue_bind(mc->conn, channel->id, current_queue,
+			amqp_cstring_bytes(exchange),
+			amqp_cstring_bytes(routing_key),
+			amqp_empty_table);
+
+	if (get_rpc_reply(mc, channel).reply_type !=
+			       AMQP_RESPONSE_NORMAL) {
+		l_error("Error while binding queue");
+		return -1;
+	}
+
+	return 0;
+}
+
+static int mq_unbind_queue(struct mq_connection *mc, const char *exchange,
+			   const char *routing_key)
+{
+	struct mq_channel *channel = &mc->channels[MQ_CHANNEL_CONTROL];
+
+	if (exchange == NULL || routing_key == NULL)
+		return -1;
+
+	amqp_queue_unbind(mc->conn, channel->id, current_queue,
+			  amqp_cstring_bytes(exchange),
+			  amqp_cstring_bytes(routing_key),
+			  amqp_empty_table);
+
+	if (get_rpc_reply(mc, channel).reply_type !=
+			       AMQP_RESPONSE_NORMAL) {
+		l_error("Error while unbinding queue");
+		return -1;
+	}
+
+	return 0;
+}
+
+static int mq_publish(struct mq_connection *mc,
+		      struct mq_channel *channel,
+		      const struct mq_publish_template *template,
+		      const char *exchange,
+		      const char *routing_key,
+		      uint64_t expiration_ms,
+		      uint8_t priority,
+		      mq_delivery_mode delivery_mode,
+		      const char *reply_to,
+		      const char *correlation_id,
+		      const char *content_type,
+		      const char *content_encoding,
+		      const char *body, size_t body_len)
+{
+	amqp_basic_properties_t props = template->props;
+	amqp_bytes_t routing_key_bytes;
+	amqp_bytes_t body_bytes;
+	char expiration_str[MQ_EXPIRATION_STR_LEN];
+	int8_t rc; // Return Code
+
+	if (mq_declare_exchange(mc, exchange, template->exchange_type) < 0)
+		return -1;
+
+	if (props._flags & AMQP_BASIC_REPLY_TO_FLAG) {
+		if (!reply_to || !correlation_id)
+			return -1;
+
+		props.reply_to = amqp_cstring_bytes(reply_to);
+		props.correlation_id = amqp_cstring_bytes(correlation_id);
+	}
+
+	if (delivery_mode == MQ_DELIVERY_MODE_TRANSIENT)
+		props.delivery_mode = AMQP_DELIVERY_NONPERSISTENT;
+
+	if (content_type)
+		props.content_type = amqp_cstring_bytes(content_type);
+
+	if (content_encoding) {
+		props._flags |= AMQP_BASIC_CONTENT_ENCODING_FLAG;
+		props.content_encoding = amqp_cstring_bytes(content_encoding);
+	}
+
+	if (priority) {
+		props._flags |= AMQP_BASIC_PRIORITY_FLAG;
+		props.priority = priority;
+	}
+
+	/* The template expiration is rendered once, render only others */
+	if (!expiration_ms) {
+		props._flags &= ~AMQP_BASIC_EXPIRATION_FLAG;
+	} else if (expiration_ms != MQ_MSG_EXPIRATION_TIME_MS) {
+		snprintf(expiration_str, sizeof(expiration_str), "%"PRIu64,
+			 expiration_ms);
+		props.expiration = amqp_cstring_bytes(expiration_str);
+	}
+
+	if (routing_key)
+		routing_key_bytes = amqp_cstring_bytes(routing_key);
+	else
+		routing_key_bytes = amqp_empty_bytes;
+
+	if (content_encoding)
+		l_debug("Publish -> exchange: %s, routingkey: %s\n"
+			"Body: %zu bytes, %s encoded\n",
+			exchange,
+			routing_key,
+			body_len, content_encoding);
+	else if (content_type)
+		l_debug("Publish -> exchange: %s, routingkey: %s\n"
+			"Body: %zu bytes of %s\n",
+			exchange,
+			routing_key,
+			body_len, content_type);
+	else
+		l_debug("Publish -> exchange: %s, routingkey: %s\nBody: %.*s\n",
+			exchange,
+			routing_key,
+			(int) body_len, body);
+
+	body_bytes.len = body_len;
+	body_bytes.bytes = (void *) body;
+
+	rc = amqp_basic_publish(mc->conn, channel->id,
+			amqp_cstring_bytes(exchange),
+			routing_key_bytes,
+			0 /* mandatory */,
+			0 /* immediate */,
+			&props, body_bytes);
+	if (rc < 0)
+		l_error("amqp_basic_publish(): %s",
+			amqp_error_string2(rc));
+
+	return rc;
+}
+
+/**
+ * mq_message_body_len:
+ * @message: message to be published
+ *
+ * Returns: the length of the body of @message, whether a string or binary.
+ */
+size_t mq_message_body_len(const mq_message_data_t *message)
+{
+	return message->body_len ? message->body_len : strlen(message->body);
+}
+
+static const struct mq_publish_template *message_template(
+						mq_message_type msg_type)
+{
+	switch (msg_type) {
+		case MQ_MESSAGE_TYPE_DIRECT:
+			return &mq_ctx.direct_template;
+		case MQ_MESSAGE_TYPE_DIRECT_RPC:
+			return &mq_ctx.rpc_template;
+		case MQ_MESSAGE_TYPE_FANOUT:
+			return &mq_ctx.fanout_template;
+		default:
+			return NULL;
+	}
+}
+
+/* Channel carrying the traffic class of the message type */
+static struct mq_channel *message_channel(struct mq_connection *mc,
+					  mq_message_type msg_type)
+{
+	const struct mq_publish_template *template;
+
+	template = message_template(msg_type);
+	if (!template)
+		return NULL;
+
+	return &mc->channels[template->channel];
+}
+
+static int send_message(struct mq_connection *mc,
+			const mq_message_data_t *message,
+			mq_confirm_cb_t confirm_cb, void *user_data)
+{
+	const struct mq_publish_template *template;
+	struct mq_channel *channel;
+	struct mq_pending_confirm *pending;
+	int res;
+
+	template = message_template(message->msg_type);
+	if (!template)
+		return -1;
+
+	channel = &mc->channels[template->channel];
+	if (!channel->open)
+		return -ENOTCONN;
+
+	if (channel->confirms_enabled &&
+	    l_queue_length(channel->pending_confirms) >=
+						mq_ctx.confirm_window) {
+		l_error("Publisher confirms window is full");
+		return -EBUSY;
+	}
+
+	res = mq_publish(mc, channel, template, message->exchange,
+			 message->msg_type == MQ_MESSAGE_TYPE_FANOUT ?
+			 NULL : message->routing_key,
+			 message->expiration_ms, message->priority,
+			 message->delivery_mode, message->reply_to,
+			 message->correlation_id, message->content_type,
+			 message->content_encoding, message->body,
+			 mq_message_body_len(message));
+
+	if (res < 0)
+		return res;
+
+	channel->published++;
+
+	if (!channel->confirms_enabled)
+		return res;
+
+	/*
+	 * Every message published on a confirm channel takes a delivery tag,
+	 * even when nobody waits for its confirmation.
+	 */
+	pending = l_new(struct mq_pending_confirm, 1);
+	pending->delivery_tag = channel->next_delivery_tag++;
+	pending->confirm_cb = confirm_cb;
+	pending->user_data = user_data;
+	l_queue_push_tail(channel->pending_confirms, pending);
+
+	return res;
+}
+
+/*
+ * Checks if the socket send buffer fits a message, so publishing it won't
+ * block the main loop. Always true if backpressure isn't enabled.
+ */
+static bool socket_has_room(struct mq_connection *mc, size_t len)
+{
+	int queued;
+
+	if (!mq_ctx.write_high_watermark || !mc->sndbuf)
+		return true;
+
+	if (ioctl(amqp_get_sockfd(mc->conn), SIOCOUTQ, &queued) < 0)
+		return true;
+
+	/* A message larger than the buffer is only sent on an empty one */
+	if (len + MQ_FRAME_OVERHEAD > (size_t) mc->sndbuf)
+		return queued == 0;
+
+	return queued + len + MQ_FRAME_OVERHEAD <= (size_t) mc->sndbuf;
+}
+
+static bool backlog_is_empty(struct mq_connection *mc)
+{
+	return outbox_is_empty(mc->outbox) && spool_is_empty(mc->spool);
+}
+
+static void on_spool_confirm(bool acked, void *user_data)
+{
+	struct mq_spool_confirm *spool_confirm = user_data;
+	struct mq_connection *mc = spool_confirm->mc;
+	unsigned int seq = spool_confirm->seq;
+
+	l_free(spool_confirm);
+
+	if (!mc->spool)
+		return;
+
+	if (acked) {
+		spool_commit(mc->spool, seq);
+		return;
+	}
+
+	/* Publish again everything from the first unconfirmed message */
+	spool_rewind(mc->spool);
+	if (mc->connected)
+		schedule_backlog_drain(mc);
+}
+
+/*
+ * Publishes the oldest message kept while the broker was unreachable.
+ * Messages from the spool are published straight from the mapped segment
+ * and only committed once confirmed, when confirms are enabled.
+ *
+ * Returns 1 if a message was published, 0 if there is none or a negative
+ * integer otherwise.
+ */
+static int replay_message(struct mq_connection *mc)
+{
+	mq_message_data_t message;
+	struct mq_channel *channel;
+	struct mq_spool_confirm *spool_confirm = NULL;
+	unsigned int seq;
+
+	if (mc->spool) {
+		if (!spool_peek(mc->spool, &message, &seq))
+			return 0;
+
+		if (!socket_has_room(mc, mq_message_body_len(&message)))
+			return 0;
+
+		channel = message_channel(mc, message.msg_type);
+		if (channel && channel->confirms_enabled) {
+			spool_confirm = l_new(struct mq_spool_confirm, 1);
+			spool_confirm->mc = mc;
+			spool_confirm->seq = seq;
+		}
+
+		if (send_message(mc, &message,
+				 spool_confirm ? on_spool_confirm : NULL,
+				 spool_confirm) < 0) {
+			l_free(spool_confirm);
+			return -1;
+		}
+
+		spool_advance(mc->spool);
+		if (!spool_confirm)
+			spool_commit(mc->spool, seq);
+
+		return 1;
+	}
+
+	if (!outbox_peek(mc->outbox, &message))
+		return 0;
+
+	if (!socket_has_room(mc, mq_message_body_len(&message)))
+		return 0;
+
+	if (send_message(mc, &message, NULL, NULL) < 0)
+		return -1;
+
+	outbox_pop(mc->outbox);
+
+	return 1;
+}
+
+static void on_backlog_drain(struct l_timeout *timeout, void *user_data)
+{
+	struct mq_connection *mc = user_data;
+	uint32_t burst;
+	uint32_t i;
+	int res;
+
+	/* Up to drain_rate messages per second, all at once if unlimited */
+	burst = mq_ctx.backlog_drain_rate * MQ_BACKLOG_DRAIN_INTERVAL_MS / 1000;
+	if (!burst)
+		burst = mq_ctx.backlog_drain_rate ? 1 : UINT32_MAX;
+
+	for (i = 0; i < burst && mc->connected; i++) {
+		res = replay_message(mc);
+		if (res < 0)
+			l_error("Failed to replay buffered message");
+		if (res <= 0)
+			break;
+	}
+
+	if (backlog_is_empty(mc) || !mc->connected) {
+		l_timeout_remove(mc->backlog_drain_timeout);
+		mc->backlog_drain_timeout = NULL;
+		return;
+	}
+
+	l_timeout_modify_ms(timeout, MQ_BACKLOG_DRAIN_INTERVAL_MS);
+}
+
+static void schedule_backlog_drain(struct mq_connection *mc)
+{
+	if (mc->backlog_drain_timeout || backlog_is_empty(mc))
+		return;
+
+	mc->backlog_drain_timeout = l_timeout_create_ms(1, on_backlog_drain,
+							mc, NULL);
+}
+
+static struct mq_queued_message *queued_message_new(
+					const mq_message_data_t *message,
+					mq_confirm_cb_t confirm_cb,
+					void *user_data)
+{
+	const char *fields[] = {
+		message->exchange,
+		message->routing_key,
+		message->body,
+		message->reply_to,
+		message->correlation_id,
+		message->content_type,
+		message->content_encoding
+	};
+	size_t field_len[L_ARRAY_SIZE(fields)];
+	struct mq_queued_message *queued;
+	const char **queued_fields[L_ARRAY_SIZE(fields)];
+	size_t body_len = mq_message_body_len(message);
+	size_t len = 0;
+	size_t i;
+
+	for (i = 0; i < L_ARRAY_SIZE(fields); i++) {
+		field_len[i] = fields[i] ? strlen(fields[i]) + 1 : 0;
+		len += field_len[i];
+	}
+
+	/* A binary body may hold NUL bytes, it is copied by its length */
+	len += body_len + 1 - field_len[2];
+	field_len[2] = body_len + 1;
+
+	/* A single allocation holds the message and its strings */
+	queued = l_malloc(sizeof(*queued) + len);
+	queued->message.msg_type = message->msg_type;
+	queued->message.expiration_ms = message->expiration_ms;
+	queued->message.priority = message->priority;
+	queued->message.delivery_mode = message->delivery_mode;
+	queued->message.shard_key = NULL;
+	queued->message.body_len = body_len;
+	queued->confirm_cb = confirm_cb;
+	queued->user_data = user_data;
+	queued->len = body_len + 1;
+
+	queued_fields[0] = &queued->message.exchange;
+	queued_fields[1] = &queued->message.routing_key;
+	queued_fields[2] = &queued->message.body;
+	queued_fields[3] = &queued->message.reply_to;
+	queued_fields[4] = &queued->message.correlation_id;
+	queued_fields[5] = &queued->message.content_type;
+	queued_fields[6] = &queued->message.content_encoding;
+
+	for (i = 0, len = 0; i < L_ARRAY_SIZE(fields); i++) {
+		*queued_fields[i] = fields[i] ? queued->data + len : NULL;
+		if (fields[i]) {
+			memcpy(queued->data + len, fields[i], field_len[i] - 1);
+			queued->data[len + field_len[i] - 1] = '\0';
+		}
+		len += field_len[i];
+	}
+
+	return queued;
+}
+
+/*
+ * Only data channels are reported, it is the traffic publishers are
+ * expected to throttle. Publishers are told to slow down while any member
+ * of the pool is congested.
+ */
+static void notify_watermark(struct mq_connection *mc,
+			     struct mq_channel *channel, bool congested)
+{
+	if (channel->write_congested == congested)
+		return;
+
+	channel->write_congested = congested;
+
+	if (channel != &mc->channels[MQ_CHANNEL_DATA])
+		return;
+
+	if (congested ? mq_ctx.write_congested_count++ :
+			--mq_ctx.write_congested_count)
+		return;
+
+	if (mq_ctx.watermark_cb)
+		mq_ctx.watermark_cb(congested, mq_ctx.watermark_data);
+}
+
+/*
+ * Messages leave the queue only once published. A message that can't be
+ * published stays at the head, waiting for a confirm to make room in the
+ * window, the channel to be reopened or the connection to be requeued.
+ *
+ * Returns true if the queue is stalled on a message that failed.
+ */
+static bool flush_write_queue(struct mq_connection *mc,
+			      struct mq_channel *channel)
+{
+	struct mq_queued_message *queued;
+	bool stalled = false;
+	int res;
+
+	while ((queued = l_queue_peek_head(channel->write_queue))) {
+		if (!mc->connected || !channel->open ||
+		    !socket_has_room(mc, queued->len))
+			break;
+
+		res = send_message(mc, &queued->message, queued->confirm_cb,
+				   queued->user_data);
+		if (res < 0) {
+			if (res != -EBUSY && res != -EAGAIN)
+				l_error("Failed to publish queued message");
+			stalled = true;
+			break;
+		}
+
+		l_queue_pop_head(channel->write_queue);
+		channel->write_queue_len -= queued->len;
+		l_free(queued);
+	}
+
+	if (channel->write_queue_len <= mq_ctx.write_low_watermark)
+		notify_watermark(mc, channel, false);
+
+	return stalled;
+}
+
+static bool on_writable(struct l_io *io, void *user_data)
+{
+	struct mq_connection *mc = user_data;
+	struct mq_channel *channel;
+	bool pending = false;
+	int i;
+
+	/* Channels are flushed by priority, control messages go first */
+	for (i = 0; i < MQ_CHANNEL_COUNT; i++) {
+		channel = &mc->channels[i];
+
+		/* A stalled channel is resumed by a confirm, not the socket */
+		if (!flush_write_queue(mc, channel) && channel->open &&
+		    !l_queue_isempty(channel->write_queue))
+			pending = true;
+	}
+
+	/* Keep waiting for the socket only while there is something left */
+	return pending && mc->connected;
+}
+
+/*
+ * Publishes right away if the socket can take the message, otherwise
+ * queues it to be published once the socket is writable again. Messages
+ * only wait for those queued on their own channel.
+ */
+static int write_message(struct mq_connection *mc,
+			 const mq_message_data_t *message,
+			 mq_confirm_cb_t confirm_cb, void *user_data)
+{
+	struct mq_channel *channel = message_channel(mc, message->msg_type);
+	struct mq_queued_message *queued;
+	size_t len = mq_message_body_len(message) + 1;
+
+	if (!channel)
+		return -1;
+
+	/* Congested until the queue drains down to the low watermark */
+	if (channel->write_congested)
+		return -EAGAIN;
+
+	if (l_queue_isempty(channel->write_queue) && socket_has_room(mc, len))
+		return send_message(mc, message, confirm_cb, user_data);
+
+	if (channel->write_queue_len >= mq_ctx.write_high_watermark) {
+		notify_watermark(mc, channel, true);
+		return -EAGAIN;
+	}
+
+	queued = queued_message_new(message, confirm_cb, user_data);
+	l_queue_push_tail(channel->write_queue, queued);
+	channel->write_queue_len += queued->len;
+
+	if (channel->write_queue_len >= mq_ctx.write_high_watermark)
+		notify_watermark(mc, channel, true);
+
+	l_io_set_write_handler(mc->amqp_io, on_writable, mc, NULL);
+
+	return 0;
+}
+
+static int publish_message(struct mq_connection *mc,
+			   const mq_message_data_t *message,
+			   mq_confirm_cb_t confirm_cb, void *user_data)
+{
+	int res;
+
+	/*
+	 * While disconnected or replaying buffered messages, new messages go
+	 * to the end of the buffer to keep the publishing order.
+	 */
+	if (mc->connected && backlog_is_empty(mc))
+		return mq_ctx.write_high_watermark ?
+			write_message(mc, message, confirm_cb, user_data) :
+			send_message(mc, message, confirm_cb, user_data);
+
+	if (confirm_cb)
+		return -ENOTCONN;
+
+	if (mc->spool) {
+		res = spool_append(mc->spool, message);
+		if (res < 0)
+			l_error("Failed to spool message: %s", strerror(-res));
+	} else if (mc->outbox) {
+		res = outbox_push(mc->outbox, message);
+		if (res < 0)
+			l_error("Outbound buffer is full, message dropped");
+	} else {
+		return -ENOTCONN;
+	}
+
+	if (mc->connected)
+		schedule_backlog_drain(mc);
+
+	return res;
+}
+
+/*
+ * Messages waiting for the socket when the connection drops go through the
+ * disconnected path, into the outbound buffer if there is one.
+ */
+static void requeue_channel_write_queue(struct mq_connection *mc,
+					struct mq_channel *channel)
+{
+	struct l_queue *write_queue = channel->write_queue;
+	struct mq_queued_message *queued;
+
+	if (l_queue_isempty(write_queue))
+		return;
+
+	channel->write_queue = l_queue_new();
+	channel->write_queue_len = 0;
+
+	/* The queue is empty, its messages aren't refused as congested */
+	notify_watermark(mc, channel, false);
+
+	while ((queued = l_queue_pop_head(write_queue))) {
+		if (queued->confirm_cb)
+			queued->confirm_cb(false, queued->user_data);
+		else if (publish_message(mc, &queued->message, NULL,
+					 NULL) < 0)
+			l_error("Queued message dropped");
+
+		l_free(queued);
+	}
+
+	l_queue_destroy(write_queue, NULL);
+}
+
+static void requeue_write_queue(struct mq_connection *mc)
+{
+	int i;
+
+	for (i = 0; i < MQ_CHANNEL_COUNT; i++)
+		requeue_channel_write_queue(mc, &mc->channels[i]);
+}
+
+/*
+ * Compresses the body before the message is sent, queued or buffered, so
+ * the length accounted for is the one that goes out and a replay doesn't
+ * compress it again. Bodies that don't shrink are sent as they are.
+ */
+static int publish_new_message(struct mq_connection *mc,
+			       const mq_message_data_t *message,
+			       mq_confirm_cb_t confirm_cb, void *user_data)
+{
+	mq_message_data_t compressed_message;
+	size_t body_len = mq_message_body_len(message);
+	uint8_t *compressed;
+	size_t compressed_len;
+	int res;
+
+	if (!mq_ctx.compress_threshold || message->content_encoding ||
+	    body_len < mq_ctx.compress_threshold ||
+	    compress_deflate(message->body, body_len, &compressed,
+			     &compressed_len) < 0)
+		return publish_message(mc, message, confirm_cb, user_data);
+
+	compressed_message = *message;
+	compressed_message.body = (const char *) compressed;
+	compressed_message.body_len = compressed_len;
+	compressed_message.content_encoding = COMPRESS_ENCODING_DEFLATE;
+
+	res = publish_message(mc, &compressed_message, confirm_cb, user_data);
+	l_free(compressed);
+
+	return res;
+}
+
+/*
+ * Picks the member of the pool for a key, so every message of a device
+ * goes through the same connection and keeps its order.
+ */
+static struct mq_connection *shard_connection(const char *shard_key)
+{
+	if (!shard_key || mq_ctx.pool_size == 1)
+		return &mq_ctx.pool[0];
+
+	return &mq_ctx.pool[l_str_hash(shard_key) % mq_ctx.pool_size];
+}
+
+/**
+ * mq_publish_message:
+ * @message: message data to be published
+ *
+ * Publish a message with exchange type Direct with a
+ * Remote Procedure Call (RPC) pattern to relate a message
+ * sent to your reply.
+ *
+ * Returns: 0 if successful and negative integer otherwise.
+ */
+int8_t mq_publish_message(const mq_message_data_t *message) {
+	if (!mq_ctx.pool)
+		return -ENOTCONN;
+
+	return publish_new_message(shard_connection(message->shard_key),
+				   message, NULL, NULL);
+}
+
+/**
+ * mq_publish_message_confirm:
+ * @message: message data to be published
+ * @confirm_cb: callback called when the broker confirms the message
+ * @user_data: user data provided to callback
+ *
+ * Publish a message and track its delivery tag until the broker acks or
+ * nacks it. If the connection drops first, @confirm_cb is called as nacked.
+ * Requires publisher confirms to be enabled with mq_set_confirm_window().
+ *
+ * Returns: 0 if successful and negative integer otherwise.
+ */
+int mq_publish_message_confirm(const mq_message_data_t *message,
+			       mq_confirm_cb_t confirm_cb, void *user_data)
+{
+	struct mq_connection *mc;
+	struct mq_channel *channel;
+
+	if (!mq_ctx.pool)
+		return -ENOTSUP;
+
+	mc = shard_connection(message->shard_key);
+	channel = message_channel(mc, message->msg_type);
+	if (!channel || !channel->confirms_enabled)
+		return -ENOTSUP;
+
+	return publish_new_message(mc, message, confirm_cb, user_data);
+}
+
+/**
+ * mq_set_confirm_window:
+ * @window: maximum number of unconfirmed messages, 0 disables confirms
+ *
+ * Set the channels in publisher confirm mode. It takes effect on the next
+ * connection to the broker, so it should be called before mq_start().
+ * The window applies to each channel of each connection.
+ *
+ * Returns: 0 if successful and -1 otherwise.
+ */
+int mq_set_confirm_window(uint32_t window)
+{
+	mq_ctx.confirm_window = window;
 
-	/* Set up to bind a queue to an exchange */
-	amqp_queue_bind(mq_ctx.conn, 1, current_queue,
-			amqp_cstring_bytes(exchange),
-			amqp_cstring_bytes(routing_key),
-			amqp_empty_table);
+	return 0;
+}
 
-	if (amqp_get_rpc_reply(mq_ctx.conn).reply_type !=
-			       AMQP_RESPONSE_NORMAL) {
-		l_error("Error while binding queue");
+/**
+ * mq_set_compression:
+ * @threshold: body length from which messages are compressed, 0 disables
+ * compression
+ *
+ * Compresses the body of the messages published from now on that are at
+ * least @threshold bytes long. Compressed messages are labeled with their
+ * content encoding. Received messages are decompressed regardless.
+ *
+ * Returns: 0 if successful and -1 otherwise.
+ */
+int mq_set_compression(size_t threshold)
+{
+	mq_ctx.compress_threshold = threshold;
+
+	return 0;
+}
+
+/**
+ * mq_set_receive_budget:
+ * @max_msgs: messages consumed at most each time the socket is readable
+ * @max_ms: time in milliseconds spent at most consuming them
+ *
+ * Bounds how long received messages already buffered by the AMQP library
+ * are consumed at once. The remaining ones are consumed on the next
+ * iteration of the main loop.
+ *
+ * Returns: 0 if successful and -1 otherwise.
+ */
+int mq_set_receive_budget(uint32_t max_msgs, uint32_t max_ms)
+{
+	if (!max_msgs || !max_ms)
 		return -1;
-	}
+
+	mq_ctx.receive_budget_msgs = max_msgs;
+	mq_ctx.receive_budget_ms = max_ms;
+
+	return 0;
+}
+
+/**
+ * mq_set_consumer_ack:
+ * @prefetch: maximum number of unacknowledged messages pushed by the broker,
+ * 0 consumes without acknowledgements
+ * @ack_interval_ms: time in milliseconds an ack is held at most to be sent
+ * along with the following ones, 0 acks every message right away
+ *
+ * Set the consumer in manual acknowledgement mode. Messages consumed by the
+ * read callback are acked, several at once, while the ones it fails to
+ * consume are rejected and put on the queue again, unless they were
+ * already redelivered, be it after a failure or a dropped connection. It
+ * takes effect on the next call to mq_consumer_queue().
+ *
+ * Returns: 0 if successful and -1 otherwise.
+ */
+int mq_set_consumer_ack(uint16_t prefetch, uint32_t ack_interval_ms)
+{
+	mq_ctx.prefetch_count = prefetch;
+	mq_ctx.ack_interval_ms = ack_interval_ms;
 
 	return 0;
 }
 
-static int mq_publish(const char *exchange,
-			      const char *type,
-			      const char *routing_key,
-			      amqp_table_entry_t *headers,
-			      size_t num_headers,
-			      uint64_t expiration_ms,
-			      amqp_bytes_t reply_to,
-			      const char *correlation_id,
-			      const char *body)
+static void apply_write_queue(struct mq_connection *mc)
 {
-	amqp_basic_properties_t props;
-	amqp_rpc_reply_t resp;
-	amqp_bytes_t routing_key_bytes;
-	char *expiration_str;
-	int8_t rc; // Return Code
+	struct mq_channel *channel;
+	int i;
 
-	/* Declare the exchange as durable */
-	amqp_exchange_declare(mq_ctx.conn, 1,
-			amqp_cstring_bytes(exchange),
-			amqp_cstring_bytes(type),
-			0 /* passive*/,
-			1 /* durable */,
-			0 /* auto_delete*/,
-			0 /* internal */,
-			amqp_empty_table);
-	resp = amqp_get_rpc_reply(mq_ctx.conn);
-	if (resp.reply_type != AMQP_RESPONSE_NORMAL) {
-		l_error("amqp_exchange_declare(): %s",
-			mq_rpc_reply_string(resp));
-		return -1;
+	for (i = 0; i < MQ_CHANNEL_COUNT; i++) {
+		channel = &mc->channels[i];
+
+		l_queue_destroy(channel->write_queue, NULL);
+		channel->write_queue = mq_ctx.write_high_watermark ?
+							l_queue_new() : NULL;
+		channel->write_queue_len = 0;
+		channel->write_congested = false;
 	}
+}
 
-	props._flags =	AMQP_BASIC_CONTENT_TYPE_FLAG	|
-			AMQP_BASIC_DELIVERY_MODE_FLAG;
+/**
+ * mq_set_write_queue:
+ * @high_watermark: queued bytes that make publishing fail with -EAGAIN,
+ *		    0 disables the queue
+ * @low_watermark: queued bytes below which publishing is accepted again
+ * @watermark_cb: callback called when crossing the watermarks
+ * @user_data: user data provided to callback
+ *
+ * Never block the main loop writing to the broker. Messages the socket
+ * can't take right away are queued per channel and published when it is
+ * writable, control messages first. Once a queue reaches @high_watermark,
+ * publishing on its channel fails until the queue drains to
+ * @low_watermark. @watermark_cb is called with true and false when the
+ * data channel crosses them.
+ *
+ * Returns: 0 if successful and -1 otherwise.
+ */
+int mq_set_write_queue(size_t high_watermark, size_t low_watermark,
+		       mq_watermark_cb_t watermark_cb, void *user_data)
+{
+	unsigned int i;
+	int j;
 
-	if (reply_to.bytes) {
-		if (correlation_id)
-			props.correlation_id =
-					amqp_cstring_bytes(correlation_id);
-		else
-			return -1;
+	if (low_watermark > high_watermark)
+		return -1;
 
-		props._flags |= AMQP_BASIC_REPLY_TO_FLAG |
-				AMQP_BASIC_CORRELATION_ID_FLAG;
+	for (i = 0; mq_ctx.pool && i < mq_ctx.pool_size; i++)
+		for (j = 0; j < MQ_CHANNEL_COUNT; j++)
+			if (!l_queue_isempty(
+				    mq_ctx.pool[i].channels[j].write_queue))
+				return -1;
 
-		props.reply_to = amqp_bytes_malloc_dup(reply_to);
-		if (!props.reply_to.bytes) {
-			l_error("Out of memory while copying queue name");
-			return -1;
-		}
-	} else {
-		props.reply_to = amqp_empty_bytes;
-	}
+	mq_ctx.write_high_watermark = high_watermark;
+	mq_ctx.write_low_watermark = low_watermark;
+	mq_ctx.write_congested_count = 0;
+	mq_ctx.watermark_cb = watermark_cb;
+	mq_ctx.watermark_data = user_data;
 
-	if (expiration_ms) {
-		props._flags |= AMQP_BASIC_EXPIRATION_FLAG;
-		expiration_str = l_strdup_printf("%"PRIu64, expiration_ms);
-		props.expiration = amqp_cstring_bytes(expiration_str);
-	}
+	for (i = 0; mq_ctx.pool && i < mq_ctx.pool_size; i++)
+		apply_write_queue(&mq_ctx.pool[i]);
+
+	return 0;
+}
 
-	if (num_headers > 0) {
-		props._flags |= AMQP_BASIC_HEADERS_FLAG;
-		props.headers.num_entries = num_headers;
-		props.headers.entries = headers;
+static int apply_outbox(struct mq_connection *mc)
+{
+	l_timeout_remove(mc->backlog_drain_timeout);
+	mc->backlog_drain_timeout = NULL;
+	outbox_free(mc->outbox);
+	mc->outbox = NULL;
+
+	if (!mq_ctx.outbox_capacity)
+		return 0;
+
+	mc->outbox = outbox_new(mq_ctx.outbox_capacity / mq_ctx.pool_size,
+				mq_ctx.outbox_policy);
+	if (!mc->outbox) {
+		l_error("Failed to allocate outbound buffer");
+		return -1;
 	}
 
-	props.content_type = amqp_cstring_bytes("text/plain");
-	props.delivery_mode = AMQP_DELIVERY_PERSISTENT;
+	return 0;
+}
 
-	if (routing_key)
-		routing_key_bytes = amqp_cstring_bytes(routing_key);
+/**
+ * mq_set_outbox:
+ * @capacity: size in bytes of the buffer, 0 disables buffering
+ * @policy: which messages to drop when the buffer is full
+ * @drain_rate: messages replayed per second on reconnection, 0 is unlimited
+ *
+ * Set up a fixed size buffer holding messages published while the broker
+ * is unreachable. Buffered messages are published again once the
+ * connection is reestablished. Any message already buffered is discarded.
+ * With a connection pool, each connection gets an equal share of
+ * @capacity.
+ *
+ * Returns: 0 if successful and -1 otherwise.
+ */
+int mq_set_outbox(size_t capacity, mq_outbox_policy policy,
+		  uint32_t drain_rate)
+{
+	unsigned int i;
+	int err = 0;
+
+	if (capacity && policy != MQ_OUTBOX_DROP_OLDEST &&
+	    policy != MQ_OUTBOX_DROP_NEWEST)
+		return -1;
+
+	mq_ctx.outbox_capacity = capacity;
+	mq_ctx.outbox_policy = policy;
+	mq_ctx.backlog_drain_rate = drain_rate;
+
+	for (i = 0; mq_ctx.pool && i < mq_ctx.pool_size; i++)
+		if (apply_outbox(&mq_ctx.pool[i]) < 0)
+			err = -1;
+
+	return err;
+}
+
+static int apply_spool(struct mq_connection *mc)
+{
+	char *path;
+
+	l_timeout_remove(mc->backlog_drain_timeout);
+	mc->backlog_drain_timeout = NULL;
+	spool_close(mc->spool);
+	mc->spool = NULL;
+
+	if (!mq_ctx.spool_path)
+		return 0;
+
+	if (mc->index)
+		path = l_strdup_printf("%s/%u", mq_ctx.spool_path, mc->index);
 	else
-		routing_key_bytes = amqp_empty_bytes;
+		path = l_strdup(mq_ctx.spool_path);
 
-	l_debug("Publish -> exchange: %s, routingkey: %s\nBody: %s\n",
-		exchange,
-		routing_key,
-		body);
+	mc->spool = spool_open(path, mq_ctx.spool_segment_size);
+	l_free(path);
+	if (!mc->spool)
+		return -1;
 
-	rc = amqp_basic_publish(mq_ctx.conn, 1,
-			amqp_cstring_bytes(exchange),
-			routing_key_bytes,
-			0 /* mandatory */,
-			0 /* immediate */,
-			&props, amqp_cstring_bytes(body));
-	if (rc < 0)
-		l_error("amqp_basic_publish(): %s",
-			amqp_error_string2(rc));
+	if (mc->connected)
+		schedule_backlog_drain(mc);
+
+	return 0;
+}
+
+/**
+ * mq_set_spool:
+ * @path: directory to keep the spool files, NULL disables the spool
+ * @segment_size: size in bytes of each spool file
+ *
+ * Keep messages published while the broker is unreachable on disk instead
+ * of the in-memory buffer, so they are published even after the process
+ * restarts. Messages spooled by a previous process are published on the
+ * next connection. With confirms enabled, a message leaves the spool only
+ * after the broker confirms it. With a connection pool, the first
+ * connection spools in @path and each other one in a subdirectory named
+ * after its index.
+ *
+ * Returns: 0 if successful and -1 otherwise.
+ */
+int mq_set_spool(const char *path, size_t segment_size)
+{
+	unsigned int i;
+	int err = 0;
 
-	if (expiration_ms)
-		l_free(expiration_str);
+	l_free(mq_ctx.spool_path);
+	mq_ctx.spool_path = l_strdup(path);
+	mq_ctx.spool_segment_size = segment_size;
 
-	if (props.reply_to.bytes)
-		amqp_bytes_free(props.reply_to);
+	for (i = 0; mq_ctx.pool && i < mq_ctx.pool_size; i++)
+		if (apply_spool(&mq_ctx.pool[i]) < 0)
+			err = -1;
 
-	return rc;
+	return err;
 }
 
 /**
- * mq_publish_message:
- * @message: message data to be published
+ * mq_get_outbox_stats:
+ * @stats: filled with the outbound buffer counters
  *
- * Publish a message with exchange type Direct with a
- * Remote Procedure Call (RPC) pattern to relate a message
- * sent to your reply.
+ * Get the counters of the buffer set up with mq_set_outbox(), added up
+ * over the connections of the pool.
+ */
+void mq_get_outbox_stats(mq_outbox_stats_t *stats)
+{
+	mq_outbox_stats_t member_stats;
+	unsigned int i;
+
+	memset(stats, 0, sizeof(*stats));
+
+	for (i = 0; mq_ctx.pool && i < mq_ctx.pool_size; i++) {
+		outbox_get_stats(mq_ctx.pool[i].outbox, &member_stats);
+
+		stats->len += member_stats.len;
+		stats->buffered += member_stats.buffered;
+		stats->dropped += member_stats.dropped;
+		stats->replayed += member_stats.replayed;
+	}
+}
+
+/**
+ * mq_get_channel_stats:
+ * @channel_class: channel to get the counters from
+ * @stats: filled with the channel state and counters
  *
- * Returns: 0 if successful and negative integer otherwise.
+ * Get the state and counters of the channel carrying a class of traffic.
+ * With a connection pool, the channel is open only if it is open on every
+ * connection, congested if it is congested on any of them and the counters
+ * are added up.
+ *
+ * Returns: 0 if successful and -1 otherwise.
  */
-int8_t mq_publish_message(const mq_message_data_t *message) {
-	int8_t res;
-	switch (message->msg_type) {
-		case MQ_MESSAGE_TYPE_DIRECT:
-			res = mq_publish(message->exchange,
-				AMQP_EXCHANGE_TYPE_DIRECT,
-				message->routing_key, headers, num_of_headers,
-				message->expiration_ms, amqp_empty_bytes, NULL,
-				message->body);
-			break;
-		case MQ_MESSAGE_TYPE_DIRECT_RPC:
-			{
-				amqp_bytes_t reply_to = amqp_cstring_bytes(
-					message->reply_to);
-				res = mq_publish(message->exchange,
-					AMQP_EXCHANGE_TYPE_DIRECT,
-					message->routing_key, headers,
-					num_of_headers, message->expiration_ms,
-					reply_to, message->correlation_id,
-					message->body);
-			break;
-			}
-		case MQ_MESSAGE_TYPE_FANOUT:
-			res = mq_publish(message->exchange,
-				AMQP_EXCHANGE_TYPE_FANOUT, NULL, headers,
-				num_of_headers, message->expiration_ms,
-				amqp_empty_bytes, NULL, message->body);
-			break;
-		default:
-			res = -1;
+int mq_get_channel_stats(mq_channel_class channel_class,
+			 mq_channel_stats_t *stats)
+{
+	struct mq_channel *channel;
+	unsigned int i;
+
+	if (channel_class >= MQ_CHANNEL_COUNT || !mq_ctx.pool)
+		return -1;
+
+	memset(stats, 0, sizeof(*stats));
+	stats->open = true;
+
+	for (i = 0; i < mq_ctx.pool_size; i++) {
+		channel = &mq_ctx.pool[i].channels[channel_class];
+
+		stats->open = stats->open && channel->open;
+		stats->congested = stats->congested ||
+				   channel->write_congested;
+		stats->queued += l_queue_length(channel->write_queue);
+		stats->queued_bytes += channel->write_queue_len;
+		stats->unconfirmed +=
+				l_queue_length(channel->pending_confirms);
+		stats->published += channel->published;
+		stats->acked += channel->acked;
+		stats->nacked += channel->nacked;
+		stats->reopened += channel->reopened;
 	}
-	return res;
+
+	return 0;
 }
 
 /**
@@ -496,28 +2294,63 @@ int8_t mq_publish_message(const mq_message_data_t *message) {
 int mq_prepare_direct_queue(const char *exchange,
 			    const char *routing_key)
 {
-	return mq_prepare_queue(exchange, AMQP_EXCHANGE_TYPE_DIRECT,
-				 routing_key);
+	if (!mq_ctx.consumer || !mq_ctx.consumer->conn)
+		return -1;
+
+	return mq_prepare_queue(mq_ctx.consumer, exchange,
+				AMQP_EXCHANGE_TYPE_DIRECT, routing_key);
+}
+
+/**
+ * mq_unbind_direct_queue:
+ * @exchange: exchange the routing key is bound to
+ * @routing_key: routing key to unbind
+ *
+ * Stops routing the messages of @routing_key to the consumer queue. Other
+ * bindings of the queue are kept.
+ *
+ * Returns: 0 if successful and -1 otherwise.
+ */
+int mq_unbind_direct_queue(const char *exchange, const char *routing_key)
+{
+	if (!mq_ctx.consumer || !mq_ctx.consumer->conn ||
+	    !current_queue.bytes)
+		return -1;
+
+	return mq_unbind_queue(mq_ctx.consumer, exchange, routing_key);
 }
 
 /**
  * mq_declare_new_queue:
  * @name: queue's name
+ * @shard_key: key picking the connection of the pool used to consume
  *
- * Declares a durable queue in amqp connection.
+ * Declares a durable queue in amqp connection. The queue is bound and
+ * consumed on the same connection.
  *
  * Returns: the queue declared or NULL otherwise.
  */
-int mq_declare_new_queue(const char *name)
+int mq_declare_new_queue(const char *name, const char *shard_key)
 {
+	struct mq_connection *mc;
+	struct mq_channel *channel;
 	amqp_queue_declare_ok_t *r;
 
-	if (!mq_ctx.conn) {
+	if (!mq_ctx.pool) {
 		current_queue.bytes = NULL;
 		return -1;
 	}
 
-	r = amqp_queue_declare(mq_ctx.conn, 1,
+	mc = shard_connection(shard_key);
+	channel = &mc->channels[MQ_CHANNEL_CONTROL];
+	mq_ctx.consumer = mc;
+
+	if (!mc->conn) {
+		current_queue.bytes = NULL;
+		return -1;
+	}
+
+	r = amqp_queue_declare(mc->conn, channel->id,
 			amqp_cstring_bytes(name),
 			0, /* passive */
 			1, /* durable */
@@ -525,8 +2358,7 @@ int mq_declare_new_queue(const char *name)
 			0, /* auto-delete */
 			amqp_empty_table);
 
-	if (amqp_get_rpc_reply(mq_ctx.conn).reply_type !=
-			       AMQP_RESPONSE_NORMAL) {
+	if (get_rpc_reply(mc, channel).reply_type != AMQP_RESPONSE_NORMAL) {
 		l_error("Error declaring queue name");
 		current_queue.bytes = NULL;
 		return -1;
@@ -547,104 +2379,335 @@ int mq_declare_new_queue(const char *name)
  */
 void mq_delete_queue(void)
 {
+	struct mq_connection *mc = mq_ctx.consumer;
+
 	if (current_queue.bytes) {
-		if (mq_ctx.conn) {
-			amqp_queue_delete(mq_ctx.conn, 1, current_queue,
-				0, 0);
-			amqp_rpc_reply_t res = amqp_get_rpc_reply(mq_ctx.conn);
+		if (mc && mc->conn) {
+			amqp_queue_delete(mc->conn,
+				mc->channels[MQ_CHANNEL_CONTROL].id,
+				current_queue, 0, 0);
+			amqp_rpc_reply_t res = get_rpc_reply(mc,
+					&mc->channels[MQ_CHANNEL_CONTROL]);
 			if (res.reply_type != AMQP_RESPONSE_NORMAL) {
 				l_error("Error deleting queue name");
 			}
 		}
 		amqp_bytes_free(current_queue);
 		current_queue = amqp_empty_bytes;
+
+		/* The consumer is cancelled along with its queue */
+		if (mc)
+			mc->consuming = false;
 	}
 }
 
-/**
- * mq_consumer_queue:
- *
- * Start a queue consumer.
- *
- * Returns: 0 if successful and -1 otherwise.
- */
-int mq_consumer_queue(void)
+static int start_consumer(struct mq_connection *mc)
 {
-	amqp_basic_consume(mq_ctx.conn, 1,
+	struct mq_channel *channel = &mc->channels[MQ_CHANNEL_CONTROL];
+
+	if (mq_ctx.prefetch_count) {
+		amqp_basic_qos(mc->conn, channel->id,
+				0, /* prefetch_size */
+				mq_ctx.prefetch_count,
+				0); /* global */
+
+		if (get_rpc_reply(mc, channel).reply_type !=
+		    AMQP_RESPONSE_NORMAL) {
+			l_error("Error while setting consumer prefetch");
+			return -1;
+		}
+	}
+
+	amqp_basic_consume(mc->conn, channel->id,
 			current_queue,
 			amqp_empty_bytes,
 			0, /* no_local */
-			1, /* no_ack */
+			!mq_ctx.prefetch_count, /* no_ack */
 			0, /* exclusive */
 			amqp_empty_table);
 
-	if (amqp_get_rpc_reply(mq_ctx.conn).reply_type !=
-							AMQP_RESPONSE_NORMAL) {
+	if (get_rpc_reply(mc, channel).reply_type != AMQP_RESPONSE_NORMAL) {
 		l_error("Error while starting consumer");
 		return -1;
 	}
 
+	/* Deliveries are settled as consumed, whatever is set later on */
+	mc->consumer_prefetch = mq_ctx.prefetch_count;
+	mc->consuming = true;
+
 	return 0;
 }
 
+/**
+ * mq_consumer_queue:
+ *
+ * Start a queue consumer. It is started again whenever the broker closes
+ * its channel.
+ *
+ * Returns: 0 if successful and -1 otherwise.
+ */
+int mq_consumer_queue(void)
+{
+	if (!mq_ctx.consumer)
+		return -1;
+
+	return start_consumer(mq_ctx.consumer);
+}
+
 /**
  * mq_set_read_cb:
  * @read_cb: callback to be called when receive some amqp message
  * @user_data: user data provided to callback
  *
- * Set the callback to handle received messages from amqp connection.
+ * Set the callback to handle received messages from amqp connection. Every
+ * connection of the pool is read, connections established later included.
  *
  * Returns: 0 if successful and -1 otherwise.
  */
 int mq_set_read_cb(mq_read_cb_t read_cb, void *user_data)
 {
-	int err;
+	struct mq_connection *mc;
+	unsigned int i;
+	bool started = false;
 
 	mq_ctx.read_cb = read_cb;
+	mq_ctx.read_data = user_data;
+
+	for (i = 0; mq_ctx.pool && i < mq_ctx.pool_size; i++) {
+		mc = &mq_ctx.pool[i];
+		if (!mc->amqp_io)
+			continue;
+
+		if (!l_io_set_read_handler(mc->amqp_io, on_receive, mc,
+					   NULL)) {
+			l_error("Error on set up read handler on AMQP io");
+			return -1;
+		}
+
+		started = true;
+	}
 
-	if (!mq_ctx.amqp_io) {
+	if (!started) {
 		l_error("Error amqp service not started");
 		return -1;
 	}
 
-	err = l_io_set_read_handler(mq_ctx.amqp_io, on_receive,
-				    user_data, NULL);
-	if (!err) {
-		l_io_destroy(mq_ctx.amqp_io);
-		l_error("Error on set up read handler on AMQP io");
-		return -1;
+	return 0;
+}
+
+static void init_publish_template(struct mq_publish_template *template,
+				  const char *exchange_type,
+				  mq_channel_class channel, bool rpc)
+{
+	amqp_basic_properties_t *props = &template->props;
+
+	memset(template, 0, sizeof(*template));
+
+	template->exchange_type = exchange_type;
+	template->channel = channel;
+
+	props->_flags = AMQP_BASIC_CONTENT_TYPE_FLAG |
+			AMQP_BASIC_DELIVERY_MODE_FLAG |
+			AMQP_BASIC_EXPIRATION_FLAG;
+	props->content_type = amqp_cstring_bytes(MQ_CONTENT_TYPE);
+	props->delivery_mode = AMQP_DELIVERY_PERSISTENT;
+	props->expiration = amqp_cstring_bytes(mq_ctx.expiration_str);
+
+	if (num_of_headers > 0) {
+		props->_flags |= AMQP_BASIC_HEADERS_FLAG;
+		props->headers.num_entries = num_of_headers;
+		props->headers.entries = headers;
 	}
 
+	/* Reply queue and correlation id are set on each message */
+	if (rpc)
+		props->_flags |= AMQP_BASIC_REPLY_TO_FLAG |
+				 AMQP_BASIC_CORRELATION_ID_FLAG;
+}
+
+/*
+ * Builds the basic properties of each message class once, so publishing
+ * doesn't need to allocate or render them again.
+ */
+static void init_publish_templates(void)
+{
+	snprintf(mq_ctx.expiration_str, sizeof(mq_ctx.expiration_str),
+		 "%d", MQ_MSG_EXPIRATION_TIME_MS);
+
+	init_publish_template(&mq_ctx.direct_template,
+			      AMQP_EXCHANGE_TYPE_DIRECT, MQ_CHANNEL_CONTROL,
+			      false);
+	init_publish_template(&mq_ctx.rpc_template,
+			      AMQP_EXCHANGE_TYPE_DIRECT, MQ_CHANNEL_CONTROL,
+			      true);
+	init_publish_template(&mq_ctx.fanout_template,
+			      AMQP_EXCHANGE_TYPE_FANOUT, MQ_CHANNEL_DATA,
+			      false);
+}
+
+/**
+ * mq_set_pool_size:
+ * @size: number of connections to the broker
+ *
+ * Spread the traffic over a pool of connections. Messages and the consumer
+ * queue are assigned to connections by hashing their shard key, so all the
+ * traffic of a device goes through the same connection. Each connection is
+ * reestablished on its own, and the pool is reported connected once all of
+ * them are up. Must be called before mq_start().
+ *
+ * Returns: 0 if successful and -1 otherwise.
+ */
+int mq_set_pool_size(unsigned int size)
+{
+	if (!size || size > MQ_POOL_MAX_SIZE || mq_ctx.pool)
+		return -1;
+
+	mq_ctx.pool_size = size;
+
 	return 0;
 }
 
+static void stop_connection(struct mq_connection *mc)
+{
+	int i;
+
+	l_timeout_remove(mc->conn_retry_timeout);
+	mc->conn_retry_timeout = NULL;
+
+	l_io_destroy(mc->amqp_io);
+	mc->amqp_io = NULL;
+
+	close_connection(mc);
+
+	l_queue_destroy(mc->declared_exchanges, l_free);
+	mc->declared_exchanges = NULL;
+
+	for (i = 0; i < MQ_CHANNEL_COUNT; i++) {
+		l_queue_destroy(mc->channels[i].pending_confirms, l_free);
+		mc->channels[i].pending_confirms = NULL;
+		l_queue_destroy(mc->channels[i].write_queue, l_free);
+		mc->channels[i].write_queue = NULL;
+	}
+
+	outbox_free(mc->outbox);
+	mc->outbox = NULL;
+
+	spool_close(mc->spool);
+	mc->spool = NULL;
+}
+
 int mq_start(char *url, mq_connected_cb_t connected_cb,
 	     mq_disconnected_cb_t disconnected_cb, void *user_data,
 		 const char *user_token)
 {
+	struct mq_connection *mc;
+	unsigned int i;
+	int j;
+
 	headers[0].key = amqp_cstring_bytes(MQ_AUTHORIZATION_HEADER);
 	headers[0].value.kind = AMQP_FIELD_KIND_UTF8;
 	headers[0].value.value.bytes = amqp_cstring_bytes(user_token);
 
+	init_publish_templates();
+
+	mq_ctx.url = l_strdup(url);
 	mq_ctx.connected_cb = connected_cb;
 	mq_ctx.disconnected_cb = disconnected_cb;
 	mq_ctx.connection_data = user_data;
+	mq_ctx.connected_count = 0;
+	mq_ctx.pool = l_new(struct mq_connection, mq_ctx.pool_size);
+
+	for (i = 0; i < mq_ctx.pool_size; i++) {
+		mc = &mq_ctx.pool[i];
+		mc->index = i;
+		mc->declared_exchanges = l_queue_new();
+
+		/*
+		 * Channel numbers start at 1, in the order of the traffic
+		 * classes
+		 */
+		for (j = 0; j < MQ_CHANNEL_COUNT; j++) {
+			mc->channels[j].id = j + 1;
+			mc->channels[j].pending_confirms = l_queue_new();
+		}
+
+		apply_write_queue(mc);
 
-	mq_ctx.conn_retry_timeout = l_timeout_create_ms(1, // start in oneshot
+		if (apply_outbox(mc) < 0 || apply_spool(mc) < 0) {
+			l_error("Failed to set up buffer of connection %u", i);
+			goto fail;
+		}
+
+		mc->conn_retry_timeout = l_timeout_create_ms(1, // oneshot
 							attempt_connection,
-							url, NULL);
+							mc, NULL);
+	}
 
 	return 0;
+
+fail:
+	/* Undo the connections set up so far, this one included */
+	do
+		stop_connection(&mq_ctx.pool[i]);
+	while (i--);
+
+	l_free(mq_ctx.pool);
+	mq_ctx.pool = NULL;
+	l_free(mq_ctx.url);
+	mq_ctx.url = NULL;
+
+	return -1;
+}
+
+/* Puts every setting back to its default, as before the first mq_start() */
+static void reset_settings(void)
+{
+	mq_ctx.pool_size = 1;
+	mq_ctx.confirm_window = 0;
+	mq_ctx.outbox_capacity = 0;
+	mq_ctx.outbox_policy = 0;
+	mq_ctx.backlog_drain_rate = 0;
+	l_free(mq_ctx.spool_path);
+	mq_ctx.spool_path = NULL;
+	mq_ctx.spool_segment_size = 0;
+	mq_ctx.write_high_watermark = 0;
+	mq_ctx.write_low_watermark = 0;
+	mq_ctx.watermark_cb = NULL;
+	mq_ctx.watermark_data = NULL;
+	mq_ctx.compress_threshold = 0;
+	mq_ctx.receive_budget_msgs = MQ_RECEIVE_BUDGET_MSGS;
+	mq_ctx.receive_budget_ms = MQ_RECEIVE_BUDGET_MS;
+	mq_ctx.prefetch_count = 0;
+	mq_ctx.ack_interval_ms = MQ_ACK_INTERVAL_MS;
 }
 
+/**
+ * mq_stop:
+ *
+ * Closes the connections to the broker. The settings given through the
+ * mq_set_*() functions are reset, so they must be given again before the
+ * next mq_start().
+ */
 void mq_stop(void)
 {
+	unsigned int i;
+
+	/* Tells a delivery being dispatched that its connection is freed */
+	mq_ctx.generation++;
+
 	mq_delete_queue();
-	l_timeout_remove(mq_ctx.conn_retry_timeout);
-	mq_ctx.conn_retry_timeout = NULL;
 
-	l_io_destroy(mq_ctx.amqp_io);
-	mq_ctx.amqp_io = NULL;
+	for (i = 0; mq_ctx.pool && i < mq_ctx.pool_size; i++)
+		stop_connection(&mq_ctx.pool[i]);
+
+	l_free(mq_ctx.pool);
+	mq_ctx.pool = NULL;
+	mq_ctx.consumer = NULL;
+	mq_ctx.connected_count = 0;
+	mq_ctx.write_congested_count = 0;
+
+	l_free(mq_ctx.url);
+	mq_ctx.url = NULL;
 
-	close_connection();
+	reset_settings();
 }
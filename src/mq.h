@@ -50,6 +50,8 @@
 
 #define MQ_DEFAULT_CORRELATION_ID "default-corrId"
 
+#define MQ_POOL_MAX_SIZE 16
+
 /**
  * @brief Defines the type of message.
  *
@@ -61,12 +63,23 @@ typedef enum {
 	MQ_MESSAGE_TYPE_FANOUT
 } mq_message_type;
 
+/**
+ * @brief Defines if the broker keeps a message on disk.
+ */
+typedef enum {
+	MQ_DELIVERY_MODE_PERSISTENT = 0,
+	MQ_DELIVERY_MODE_TRANSIENT
+} mq_delivery_mode;
+
 /**
  * @brief Defines a mq message format.
  *
  * A mq message to be exchange under amqp's protocol. This struct helds
  * authorization parameters, a header, an expiration time for the message and
- * the message's body.
+ * the message's body. An expiration of 0 means the message never expires
+ * and a priority of 0 leaves it unset. The body is a string unless its
+ * length is set, and its content type defaults to text/plain. A body with
+ * a content encoding is sent as it is, otherwise it may be compressed.
  */
 typedef struct {
 	mq_message_type msg_type;
@@ -76,20 +89,115 @@ typedef struct {
 	const char *body;
 	const char *reply_to;
 	const char *correlation_id;
+	const char *shard_key; // picks the connection of the pool, may be NULL
+	uint8_t priority;
+	mq_delivery_mode delivery_mode;
+	size_t body_len; // length of a binary body, 0 if it is a string
+	const char *content_type;
+	const char *content_encoding;
 } mq_message_data_t;
 
-typedef bool (*mq_read_cb_t) (const char *exchange, const char *routing_key,
-			      const char *body, void *user_data);
+/**
+ * @brief Defines what is dropped when the outbound buffer is full.
+ */
+typedef enum {
+	MQ_OUTBOX_DROP_OLDEST = 1,
+	MQ_OUTBOX_DROP_NEWEST
+} mq_outbox_policy;
+
+/**
+ * @brief Counters of the outbound buffer.
+ *
+ * Messages published while the broker is unreachable are buffered and
+ * replayed once the connection is back.
+ */
+typedef struct {
+	uint32_t len;
+	uint64_t buffered;
+	uint64_t dropped;
+	uint64_t replayed;
+} mq_outbox_stats_t;
+
+/**
+ * @brief Defines the AMQP channel carrying each class of traffic.
+ *
+ * Device control requests and the consumer use the control channel while
+ * device data is published on the data channel, so bulk data doesn't
+ * delay control requests and a channel error doesn't affect the other.
+ */
+typedef enum {
+	MQ_CHANNEL_CONTROL = 0,
+	MQ_CHANNEL_DATA,
+	MQ_CHANNEL_COUNT
+} mq_channel_class;
+
+/**
+ * @brief State and counters of a channel.
+ */
+typedef struct {
+	bool open;
+	bool congested;
+	uint32_t queued; // messages waiting for the socket
+	size_t queued_bytes;
+	uint32_t unconfirmed;
+	uint64_t published;
+	uint64_t acked;
+	uint64_t nacked;
+	uint64_t reopened; // times reopened after a channel error
+} mq_channel_stats_t;
+
+/**
+ * @brief Bytes owned by the AMQP library, not NUL terminated.
+ */
+typedef struct {
+	const uint8_t *ptr;
+	size_t len;
+} mq_view_t;
+
+/**
+ * @brief A received message.
+ *
+ * Its fields are views into the buffers of the AMQP library, only valid
+ * during the read callback. The content type is empty if not set.
+ */
+typedef struct {
+	mq_view_t exchange;
+	mq_view_t routing_key;
+	mq_view_t content_type;
+	mq_view_t body;
+} mq_received_message_t;
+
+typedef bool (*mq_read_cb_t) (const mq_received_message_t *message,
+			      void *user_data);
 typedef void (*mq_connected_cb_t) (void *user_data);
 typedef void (*mq_disconnected_cb_t) (void *user_data);
+typedef void (*mq_confirm_cb_t) (bool acked, void *user_data);
+typedef void (*mq_watermark_cb_t) (bool congested, void *user_data);
 
+size_t mq_message_body_len(const mq_message_data_t *message);
 int8_t mq_publish_message(const mq_message_data_t *message);
+int mq_publish_message_confirm(const mq_message_data_t *message,
+			       mq_confirm_cb_t confirm_cb, void *user_data);
+int mq_set_confirm_window(uint32_t window);
+int mq_set_compression(size_t threshold);
+int mq_set_receive_budget(uint32_t max_msgs, uint32_t max_ms);
+int mq_set_consumer_ack(uint16_t prefetch, uint32_t ack_interval_ms);
+int mq_set_write_queue(size_t high_watermark, size_t low_watermark,
+		       mq_watermark_cb_t watermark_cb, void *user_data);
+int mq_set_outbox(size_t capacity, mq_outbox_policy policy,
+		  uint32_t drain_rate);
+void mq_get_outbox_stats(mq_outbox_stats_t *stats);
+int mq_set_spool(const char *path, size_t segment_size);
+int mq_get_channel_stats(mq_channel_class channel_class,
+			 mq_channel_stats_t *stats);
 int mq_prepare_direct_queue(const char *exchange,
 			 const char *routing_key);
-int mq_declare_new_queue(const char *name);
+int mq_unbind_direct_queue(const char *exchange, const char *routing_key);
+int mq_declare_new_queue(const char *name, const char *shard_key);
 void mq_delete_queue(void);
 int mq_consumer_queue(void);
 int mq_set_read_cb(mq_read_cb_t read_cb, void *user_data);
+int mq_set_pool_size(unsigned int size);
 int mq_start(char *url, mq_connected_cb_t connected_cb,
 	     mq_disconnected_cb_t disconnected_cb, void *user_data,
 		 const char *user_token);
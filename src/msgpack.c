@@ -0,0 +1,642 @@
+/*
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2020, CESAR. All rights reserved.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+
+/**
+ * MessagePack encoding source file
+ *
+ * Writes and reads the subset of MessagePack the cloud messages use: nil,
+ * booleans, integers, floats, strings, binaries, arrays and maps.
+ * Multi-byte values are big-endian.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <ell/ell.h>
+
+#include "msgpack.h"
+
+#define MAX(x, y) ((x) > (y) ? (x) : (y))
+
+#define MSGPACK_NIL		0xc0
+#define MSGPACK_FALSE		0xc2
+#define MSGPACK_TRUE		0xc3
+#define MSGPACK_BIN8		0xc4
+#define MSGPACK_BIN16		0xc5
+#define MSGPACK_BIN32		0xc6
+#define MSGPACK_FLOAT32		0xca
+#define MSGPACK_FLOAT64		0xcb
+#define MSGPACK_UINT8		0xcc
+#define MSGPACK_UINT16		0xcd
+#define MSGPACK_UINT32		0xce
+#define MSGPACK_UINT64		0xcf
+#define MSGPACK_INT8		0xd0
+#define MSGPACK_INT16		0xd1
+#define MSGPACK_INT32		0xd2
+#define MSGPACK_INT64		0xd3
+#define MSGPACK_STR8		0xd9
+#define MSGPACK_STR16		0xda
+#define MSGPACK_STR32		0xdb
+#define MSGPACK_ARRAY16		0xdc
+#define MSGPACK_ARRAY32		0xdd
+#define MSGPACK_MAP16		0xde
+#define MSGPACK_MAP32		0xdf
+#define MSGPACK_FIXMAP		0x80
+#define MSGPACK_FIXARRAY	0x90
+#define MSGPACK_FIXSTR		0xa0
+#define MSGPACK_NEGATIVE_FIXINT	0xe0
+
+struct msgpack_header {
+	enum msgpack_type type;
+	union {
+		bool b;
+		int64_t i;
+		uint64_t u;
+		double f;
+		uint32_t len; /* Of strings and binaries, items of containers */
+	};
+};
+
+static void ensure_room(struct msgpack_writer *writer, size_t len)
+{
+	if (writer->len + len <= writer->size)
+		return;
+
+	writer->size = MAX(writer->size * 2, writer->len + len);
+	writer->buf = l_realloc(writer->buf, writer->size);
+}
+
+static void write_be(struct msgpack_writer *writer, uint8_t marker,
+		     uint64_t value, size_t len)
+{
+	size_t i;
+
+	ensure_room(writer, 1 + len);
+	writer->buf[writer->len++] = marker;
+
+	for (i = len; i > 0; i--)
+		writer->buf[writer->len++] = value >> ((i - 1) * 8);
+}
+
+static void write_len(struct msgpack_writer *writer, uint32_t len,
+		      uint8_t marker8, uint8_t marker16, uint8_t marker32)
+{
+	if (len <= UINT8_MAX && marker8)
+		write_be(writer, marker8, len, 1);
+	else if (len <= UINT16_MAX)
+		write_be(writer, marker16, len, 2);
+	else
+		write_be(writer, marker32, len, 4);
+}
+
+static void write_raw(struct msgpack_writer *writer, const void *data,
+		      size_t len)
+{
+	ensure_room(writer, len);
+	memcpy(writer->buf + writer->len, data, len);
+	writer->len += len;
+}
+
+/**
+ * msgpack_writer_init:
+ * @writer: writer to be initialized
+ * @size: initial size of the buffer, it grows as needed
+ */
+void msgpack_writer_init(struct msgpack_writer *writer, size_t size)
+{
+	writer->size = size ? size : 64;
+	writer->buf = l_malloc(writer->size);
+	writer->len = 0;
+}
+
+/**
+ * msgpack_writer_finish:
+ * @writer: writer holding the encoded data
+ * @len: filled with the length of the encoded data
+ *
+ * Hands the buffer over to the caller. It is followed by a NUL byte not
+ * counted in @len, so it can be handled as a message body.
+ *
+ * Returns: the encoded data, to be freed with l_free().
+ */
+uint8_t *msgpack_writer_finish(struct msgpack_writer *writer, size_t *len)
+{
+	uint8_t *buf;
+
+	ensure_room(writer, 1);
+	writer->buf[writer->len] = '\0';
+
+	buf = writer->buf;
+	*len = writer->len;
+
+	writer->buf = NULL;
+	writer->len = 0;
+	writer->size = 0;
+
+	return buf;
+}
+
+void msgpack_write_map(struct msgpack_writer *writer, uint32_t n)
+{
+	if (n < 16)
+		write_be(writer, MSGPACK_FIXMAP | n, 0, 0);
+	else
+		write_len(writer, n, 0, MSGPACK_MAP16, MSGPACK_MAP32);
+}
+
+void msgpack_write_array(struct msgpack_writer *writer, uint32_t n)
+{
+	if (n < 16)
+		write_be(writer, MSGPACK_FIXARRAY | n, 0, 0);
+	else
+		write_len(writer, n, 0, MSGPACK_ARRAY16, MSGPACK_ARRAY32);
+}
+
+void msgpack_write_str(struct msgpack_writer *writer, const char *str)
+{
+	size_t len = strlen(str);
+
+	if (len < 32)
+		write_be(writer, MSGPACK_FIXSTR | len, 0, 0);
+	else
+		write_len(writer, len, MSGPACK_STR8, MSGPACK_STR16,
+			  MSGPACK_STR32);
+
+	write_raw(writer, str, len);
+}
+
+void msgpack_write_bin(struct msgpack_writer *writer, const void *data,
+		       uint32_t len)
+{
+	write_len(writer, len, MSGPACK_BIN8, MSGPACK_BIN16, MSGPACK_BIN32);
+	write_raw(writer, data, len);
+}
+
+void msgpack_write_bool(struct msgpack_writer *writer, bool value)
+{
+	write_be(writer, value ? MSGPACK_TRUE : MSGPACK_FALSE, 0, 0);
+}
+
+void msgpack_write_uint(struct msgpack_writer *writer, uint64_t value)
+{
+	if (value <= INT8_MAX)
+		write_be(writer, value, 0, 0);
+	else if (value <= UINT8_MAX)
+		write_be(writer, MSGPACK_UINT8, value, 1);
+	else if (value <= UINT16_MAX)
+		write_be(writer, MSGPACK_UINT16, value, 2);
+	else if (value <= UINT32_MAX)
+		write_be(writer, MSGPACK_UINT32, value, 4);
+	else
+		write_be(writer, MSGPACK_UINT64, value, 8);
+}
+
+void msgpack_write_int(struct msgpack_writer *writer, int64_t value)
+{
+	if (value >= 0)
+		msgpack_write_uint(writer, value);
+	else if (value >= -32)
+		write_be(writer, (uint8_t) value, 0, 0);
+	else if (value >= INT8_MIN)
+		write_be(writer, MSGPACK_INT8, (uint64_t) value, 1);
+	else if (value >= INT16_MIN)
+		write_be(writer, MSGPACK_INT16, (uint64_t) value, 2);
+	else if (value >= INT32_MIN)
+		write_be(writer, MSGPACK_INT32, (uint64_t) value, 4);
+	else
+		write_be(writer, MSGPACK_INT64, (uint64_t) value, 8);
+}
+
+void msgpack_write_float(struct msgpack_writer *writer, float value)
+{
+	uint32_t bits;
+
+	memcpy(&bits, &value, sizeof(bits));
+	write_be(writer, MSGPACK_FLOAT32, bits, 4);
+}
+
+static bool read_be(struct msgpack_reader *reader, size_t len,
+		    uint64_t *value)
+{
+	size_t i;
+
+	if (reader->len - reader->pos < len)
+		return false;
+
+	for (i = 0, *value = 0; i < len; i++)
+		*value = (*value << 8) | reader->buf[reader->pos++];
+
+	return true;
+}
+
+static bool read_signed(struct msgpack_reader *reader, size_t len,
+			struct msgpack_header *hdr)
+{
+	uint64_t value;
+
+	if (!read_be(reader, len, &value))
+		return false;
+
+	hdr->type = MSGPACK_TYPE_INT;
+
+	/* Sign extend from the encoded width */
+	if (len < 8 && (value & (1ULL << (len * 8 - 1))))
+		value |= ~0ULL << (len * 8);
+
+	hdr->i = (int64_t) value;
+
+	return true;
+}
+
+static bool read_float(struct msgpack_reader *reader, size_t len,
+		       struct msgpack_header *hdr)
+{
+	uint64_t value;
+	uint32_t bits;
+	float f;
+
+	if (!read_be(reader, len, &value))
+		return false;
+
+	hdr->type = MSGPACK_TYPE_FLOAT;
+
+	if (len == sizeof(float)) {
+		bits = value;
+		memcpy(&f, &bits, sizeof(f));
+		hdr->f = f;
+	} else {
+		memcpy(&hdr->f, &value, sizeof(hdr->f));
+	}
+
+	return true;
+}
+
+static bool read_sized(struct msgpack_reader *reader, size_t len,
+		       enum msgpack_type type, struct msgpack_header *hdr)
+{
+	uint64_t value;
+
+	if (!read_be(reader, len, &value))
+		return false;
+
+	hdr->type = type;
+	hdr->len = value;
+
+	return true;
+}
+
+/*
+ * Reads the marker of the next item and whatever follows it, except the
+ * payload of strings and binaries.
+ */
+static bool read_header(struct msgpack_reader *reader,
+			struct msgpack_header *hdr)
+{
+	uint64_t value;
+	uint8_t marker;
+
+	if (reader->pos >= reader->len)
+		return false;
+
+	marker = reader->buf[reader->pos++];
+
+	if (marker <= INT8_MAX) {
+		hdr->type = MSGPACK_TYPE_UINT;
+		hdr->u = marker;
+		return true;
+	}
+
+	if (marker >= MSGPACK_NEGATIVE_FIXINT) {
+		hdr->type = MSGPACK_TYPE_INT;
+		hdr->i = (int8_t) marker;
+		return true;
+	}
+
+	if ((marker & 0xf0) == MSGPACK_FIXMAP) {
+		hdr->type = MSGPACK_TYPE_MAP;
+		hdr->len = marker & 0x0f;
+		return true;
+	}
+
+	if ((marker & 0xf0) == MSGPACK_FIXARRAY) {
+		hdr->type = MSGPACK_TYPE_ARRAY;
+		hdr->len = marker & 0x0f;
+		return true;
+	}
+
+	if ((marker & 0xe0) == MSGPACK_FIXSTR) {
+		hdr->type = MSGPACK_TYPE_STR;
+		hdr->len = marker & 0x1f;
+		return true;
+	}
+
+	switch (marker) {
+	case MSGPACK_NIL:
+		hdr->type = MSGPACK_TYPE_NIL;
+		return true;
+	case MSGPACK_FALSE:
+	case MSGPACK_TRUE:
+		hdr->type = MSGPACK_TYPE_BOOL;
+		hdr->b = marker == MSGPACK_TRUE;
+		return true;
+	case MSGPACK_UINT8:
+	case MSGPACK_UINT16:
+	case MSGPACK_UINT32:
+	case MSGPACK_UINT64:
+		if (!read_be(reader, 1 << (marker - MSGPACK_UINT8), &value))
+			return false;
+		hdr->type = MSGPACK_TYPE_UINT;
+		hdr->u = value;
+		return true;
+	case MSGPACK_INT8:
+	case MSGPACK_INT16:
+	case MSGPACK_INT32:
+	case MSGPACK_INT64:
+		return read_signed(reader, 1 << (marker - MSGPACK_INT8), hdr);
+	case MSGPACK_FLOAT32:
+		return read_float(reader, 4, hdr);
+	case MSGPACK_FLOAT64:
+		return read_float(reader, 8, hdr);
+	case MSGPACK_STR8:
+	case MSGPACK_STR16:
+	case MSGPACK_STR32:
+		return read_sized(reader, 1 << (marker - MSGPACK_STR8),
+				  MSGPACK_TYPE_STR, hdr);
+	case MSGPACK_BIN8:
+	case MSGPACK_BIN16:
+	case MSGPACK_BIN32:
+		return read_sized(reader, 1 << (marker - MSGPACK_BIN8),
+				  MSGPACK_TYPE_BIN, hdr);
+	case MSGPACK_ARRAY16:
+	case MSGPACK_ARRAY32:
+		return read_sized(reader, 2 << (marker - MSGPACK_ARRAY16),
+				  MSGPACK_TYPE_ARRAY, hdr);
+	case MSGPACK_MAP16:
+	case MSGPACK_MAP32:
+		return read_sized(reader, 2 << (marker - MSGPACK_MAP16),
+				  MSGPACK_TYPE_MAP, hdr);
+	default:
+		/* Extension types aren't used by the cloud messages */
+		return false;
+	}
+}
+
+/*
+ * Reads the next item if it is of @type. The reader doesn't move
+ * otherwise, so another type can be tried.
+ */
+static bool read_typed(struct msgpack_reader *reader, enum msgpack_type type,
+		       struct msgpack_header *hdr)
+{
+	size_t pos = reader->pos;
+
+	if (read_header(reader, hdr) && hdr->type == type)
+		return true;
+
+	reader->pos = pos;
+
+	return false;
+}
+
+static bool read_payload(struct msgpack_reader *reader, uint32_t len,
+			 const void **data)
+{
+	if (reader->len - reader->pos < len)
+		return false;
+
+	*data = reader->buf + reader->pos;
+	reader->pos += len;
+
+	return true;
+}
+
+/**
+ * msgpack_reader_init:
+ * @reader: reader to be initialized
+ * @buf: encoded data, it must outlive @reader
+ * @len: length of @buf
+ */
+void msgpack_reader_init(struct msgpack_reader *reader, const void *buf,
+			 size_t len)
+{
+	reader->buf = buf;
+	reader->len = len;
+	reader->pos = 0;
+}
+
+enum msgpack_type msgpack_peek_type(const struct msgpack_reader *reader)
+{
+	struct msgpack_reader peek = *reader;
+	struct msgpack_header hdr;
+
+	if (!read_header(&peek, &hdr))
+		return MSGPACK_TYPE_INVALID;
+
+	return hdr.type;
+}
+
+bool msgpack_read_map(struct msgpack_reader *reader, uint32_t *n)
+{
+	struct msgpack_header hdr;
+
+	if (!read_typed(reader, MSGPACK_TYPE_MAP, &hdr))
+		return false;
+
+	*n = hdr.len;
+
+	return true;
+}
+
+bool msgpack_read_array(struct msgpack_reader *reader, uint32_t *n)
+{
+	struct msgpack_header hdr;
+
+	if (!read_typed(reader, MSGPACK_TYPE_ARRAY, &hdr))
+		return false;
+
+	*n = hdr.len;
+
+	return true;
+}
+
+/**
+ * msgpack_read_str:
+ * @reader: reader to read from
+ * @str: filled with the string, which isn't NUL terminated
+ * @len: filled with the length of @str
+ *
+ * Returns: true if a string was read and false otherwise.
+ */
+bool msgpack_read_str(struct msgpack_reader *reader, const char **str,
+		      uint32_t *len)
+{
+	struct msgpack_header hdr;
+	size_t pos = reader->pos;
+
+	if (!read_typed(reader, MSGPACK_TYPE_STR, &hdr))
+		return false;
+
+	if (!read_payload(reader, hdr.len, (const void **) str)) {
+		reader->pos = pos;
+		return false;
+	}
+
+	*len = hdr.len;
+
+	return true;
+}
+
+bool msgpack_read_bin(struct msgpack_reader *reader, const void **data,
+		      uint32_t *len)
+{
+	struct msgpack_header hdr;
+	size_t pos = reader->pos;
+
+	if (!read_typed(reader, MSGPACK_TYPE_BIN, &hdr))
+		return false;
+
+	if (!read_payload(reader, hdr.len, data)) {
+		reader->pos = pos;
+		return false;
+	}
+
+	*len = hdr.len;
+
+	return true;
+}
+
+bool msgpack_read_bool(struct msgpack_reader *reader, bool *value)
+{
+	struct msgpack_header hdr;
+
+	if (!read_typed(reader, MSGPACK_TYPE_BOOL, &hdr))
+		return false;
+
+	*value = hdr.b;
+
+	return true;
+}
+
+/**
+ * msgpack_read_int:
+ * @reader: reader to read from
+ * @value: filled with the integer read
+ *
+ * Reads a signed or an unsigned integer that fits in @value.
+ *
+ * Returns: true if an integer was read and false otherwise.
+ */
+bool msgpack_read_int(struct msgpack_reader *reader, int64_t *value)
+{
+	struct msgpack_header hdr;
+	size_t pos = reader->pos;
+
+	if (read_typed(reader, MSGPACK_TYPE_INT, &hdr)) {
+		*value = hdr.i;
+		return true;
+	}
+
+	if (!read_typed(reader, MSGPACK_TYPE_UINT, &hdr))
+		return false;
+
+	if (hdr.u > INT64_MAX) {
+		reader->pos = pos;
+		return false;
+	}
+
+	*value = hdr.u;
+
+	return true;
+}
+
+bool msgpack_read_uint(struct msgpack_reader *reader, uint64_t *value)
+{
+	struct msgpack_header hdr;
+
+	if (!read_typed(reader, MSGPACK_TYPE_UINT, &hdr))
+		return false;
+
+	*value = hdr.u;
+
+	return true;
+}
+
+bool msgpack_read_double(struct msgpack_reader *reader, double *value)
+{
+	struct msgpack_header hdr;
+
+	if (!read_typed(reader, MSGPACK_TYPE_FLOAT, &hdr))
+		return false;
+
+	*value = hdr.f;
+
+	return true;
+}
+
+/**
+ * msgpack_skip:
+ * @reader: reader to move forward
+ *
+ * Skips the next item, including everything within it if it is an array
+ * or a map.
+ *
+ * Returns: true if an item was skipped and false if the data is malformed.
+ */
+bool msgpack_skip(struct msgpack_reader *reader)
+{
+	struct msgpack_header hdr;
+	uint64_t remaining = 1;
+	const void *data;
+
+	while (remaining--) {
+		if (!read_header(reader, &hdr))
+			return false;
+
+		switch (hdr.type) {
+		case MSGPACK_TYPE_STR:
+		case MSGPACK_TYPE_BIN:
+			if (!read_payload(reader, hdr.len, &data))
+				return false;
+			break;
+		case MSGPACK_TYPE_ARRAY:
+			remaining += hdr.len;
+			break;
+		case MSGPACK_TYPE_MAP:
+			remaining += (uint64_t) hdr.len * 2;
+			break;
+		case MSGPACK_TYPE_NIL:
+		case MSGPACK_TYPE_BOOL:
+		case MSGPACK_TYPE_INT:
+		case MSGPACK_TYPE_UINT:
+		case MSGPACK_TYPE_FLOAT:
+		case MSGPACK_TYPE_INVALID:
+		default:
+			break;
+		}
+	}
+
+	return true;
+}
@@ -0,0 +1,79 @@
+/*
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2020, CESAR. All rights reserved.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+
+/**
+ * MessagePack encoding header file
+ */
+
+#define MSGPACK_CONTENT_TYPE "application/msgpack"
+
+struct msgpack_writer {
+	uint8_t *buf;
+	size_t len;
+	size_t size;
+};
+
+struct msgpack_reader {
+	const uint8_t *buf;
+	size_t len;
+	size_t pos;
+};
+
+enum msgpack_type {
+	MSGPACK_TYPE_NIL,
+	MSGPACK_TYPE_BOOL,
+	MSGPACK_TYPE_INT,
+	MSGPACK_TYPE_UINT,
+	MSGPACK_TYPE_FLOAT,
+	MSGPACK_TYPE_STR,
+	MSGPACK_TYPE_BIN,
+	MSGPACK_TYPE_ARRAY,
+	MSGPACK_TYPE_MAP,
+	MSGPACK_TYPE_INVALID
+};
+
+void msgpack_writer_init(struct msgpack_writer *writer, size_t size);
+uint8_t *msgpack_writer_finish(struct msgpack_writer *writer, size_t *len);
+void msgpack_write_map(struct msgpack_writer *writer, uint32_t n);
+void msgpack_write_array(struct msgpack_writer *writer, uint32_t n);
+void msgpack_write_str(struct msgpack_writer *writer, const char *str);
+void msgpack_write_bin(struct msgpack_writer *writer, const void *data,
+		       uint32_t len);
+void msgpack_write_bool(struct msgpack_writer *writer, bool value);
+void msgpack_write_int(struct msgpack_writer *writer, int64_t value);
+void msgpack_write_uint(struct msgpack_writer *writer, uint64_t value);
+void msgpack_write_float(struct msgpack_writer *writer, float value);
+
+void msgpack_reader_init(struct msgpack_reader *reader, const void *buf,
+			 size_t len);
+enum msgpack_type msgpack_peek_type(const struct msgpack_reader *reader);
+bool msgpack_read_map(struct msgpack_reader *reader, uint32_t *n);
+bool msgpack_read_array(struct msgpack_reader *reader, uint32_t *n);
+bool msgpack_read_str(struct msgpack_reader *reader, const char **str,
+		      uint32_t *len);
+bool msgpack_read_bin(struct msgpack_reader *reader, const void **data,
+		      uint32_t *len);
+bool msgpack_read_bool(struct msgpack_reader *reader, bool *value);
+bool msgpack_read_int(struct msgpack_reader *reader, int64_t *value);
+bool msgpack_read_uint(struct msgpack_reader *reader, uint64_t *value);
+bool msgpack_read_double(struct msgpack_reader *reader, double *value);
+bool msgpack_skip(struct msgpack_reader *reader);
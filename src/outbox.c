@@ -0,0 +1,286 @@
+/*
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2020, CESAR. All rights reserved.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+/**
+ * Outbound message buffer source file
+ *
+ * Keeps serialized messages in a ring preallocated with a fixed capacity
+ * while they can't be published. Each record is a header followed by the
+ * NUL terminated strings of the message.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <errno.h>
+#include <ell/ell.h>
+
+#include "mq.h"
+#include "outbox.h"
+#include "util.h"
+
+enum outbox_field {
+	OUTBOX_FIELD_EXCHANGE,
+	OUTBOX_FIELD_ROUTING_KEY,
+	OUTBOX_FIELD_BODY,
+	OUTBOX_FIELD_REPLY_TO,
+	OUTBOX_FIELD_CORRELATION_ID,
+	OUTBOX_FIELD_CONTENT_TYPE,
+	OUTBOX_FIELD_CONTENT_ENCODING,
+	OUTBOX_FIELDS_LENGTH
+};
+
+struct outbox_record {
+	uint32_t len; /* Length of the whole record */
+	uint16_t msg_type;
+	uint8_t priority;
+	uint8_t delivery_mode;
+	uint64_t expiration_ms;
+	/* Field lengths including the terminator, 0 if NULL */
+	uint32_t field_len[OUTBOX_FIELDS_LENGTH];
+};
+
+struct outbox {
+	struct l_ringbuf *ring;
+	mq_outbox_policy policy;
+	uint8_t *record;
+	size_t record_size;
+	uint32_t len;
+	uint64_t buffered;
+	uint64_t dropped;
+	uint64_t replayed;
+};
+
+static void ring_read(struct l_ringbuf *ring, size_t offset, void *data,
+		      size_t len)
+{
+	uint8_t *dst = data;
+	size_t len_nowrap;
+	const void *src;
+
+	while (len) {
+		src = l_ringbuf_peek(ring, offset, &len_nowrap);
+		len_nowrap = MIN(len, len_nowrap);
+		memcpy(dst, src, len_nowrap);
+		dst += len_nowrap;
+		offset += len_nowrap;
+		len -= len_nowrap;
+	}
+}
+
+static void drop_head(struct outbox *outbox)
+{
+	struct outbox_record hdr;
+
+	ring_read(outbox->ring, 0, &hdr, sizeof(hdr));
+	l_ringbuf_drain(outbox->ring, hdr.len);
+	outbox->len--;
+	outbox->dropped++;
+}
+
+struct outbox *outbox_new(size_t capacity, mq_outbox_policy policy)
+{
+	struct outbox *outbox;
+
+	outbox = l_new(struct outbox, 1);
+	outbox->ring = l_ringbuf_new(capacity);
+	if (!outbox->ring) {
+		l_free(outbox);
+		return NULL;
+	}
+
+	outbox->policy = policy;
+
+	return outbox;
+}
+
+void outbox_free(struct outbox *outbox)
+{
+	if (!outbox)
+		return;
+
+	l_ringbuf_free(outbox->ring);
+	l_free(outbox->record);
+	l_free(outbox);
+}
+
+/**
+ * outbox_push:
+ * @outbox: buffer to store the message
+ * @message: message to be serialized into the buffer
+ *
+ * Appends a copy of @message. If the buffer is full, either the oldest
+ * messages or @message itself are dropped according to the buffer policy.
+ *
+ * Returns: 0 if successful and -ENOBUFS if @message was dropped.
+ */
+int outbox_push(struct outbox *outbox, const mq_message_data_t *message)
+{
+	const char *fields[OUTBOX_FIELDS_LENGTH] = {
+		message->exchange,
+		message->routing_key,
+		message->body,
+		message->reply_to,
+		message->correlation_id,
+		message->content_type,
+		message->content_encoding
+	};
+	struct outbox_record hdr;
+	int i;
+
+	hdr.len = sizeof(hdr);
+	hdr.msg_type = message->msg_type;
+	hdr.priority = message->priority;
+	hdr.delivery_mode = message->delivery_mode;
+	hdr.expiration_ms = message->expiration_ms;
+
+	for (i = 0; i < OUTBOX_FIELDS_LENGTH; i++) {
+		if (i == OUTBOX_FIELD_BODY)
+			hdr.field_len[i] = mq_message_body_len(message) + 1;
+		else if (fields[i])
+			hdr.field_len[i] = strlen(fields[i]) + 1;
+		else
+			hdr.field_len[i] = 0;
+		hdr.len += hdr.field_len[i];
+	}
+
+	if (hdr.len > l_ringbuf_capacity(outbox->ring)) {
+		outbox->dropped++;
+		return -ENOBUFS;
+	}
+
+	while (l_ringbuf_avail(outbox->ring) < hdr.len) {
+		if (outbox->policy == MQ_OUTBOX_DROP_NEWEST) {
+			outbox->dropped++;
+			return -ENOBUFS;
+		}
+
+		drop_head(outbox);
+	}
+
+	l_ringbuf_append(outbox->ring, &hdr, sizeof(hdr));
+	for (i = 0; i < OUTBOX_FIELDS_LENGTH; i++) {
+		if (!hdr.field_len[i])
+			continue;
+
+		/* A binary body may hold NUL bytes, copied by its length */
+		l_ringbuf_append(outbox->ring, fields[i], hdr.field_len[i] - 1);
+		l_ringbuf_append(outbox->ring, "", 1);
+	}
+
+	outbox->len++;
+	outbox->buffered++;
+
+	return 0;
+}
+
+/**
+ * outbox_peek:
+ * @outbox: buffer to read from
+ * @message: filled with the oldest message in the buffer
+ *
+ * The strings of @message remain valid until the next call on @outbox.
+ *
+ * Returns: true if a message was read and false if the buffer is empty.
+ */
+bool outbox_peek(struct outbox *outbox, mq_message_data_t *message)
+{
+	const char **fields[OUTBOX_FIELDS_LENGTH] = {
+		&message->exchange,
+		&message->routing_key,
+		&message->body,
+		&message->reply_to,
+		&message->correlation_id,
+		&message->content_type,
+		&message->content_encoding
+	};
+	struct outbox_record hdr;
+	size_t offset;
+	int i;
+
+	if (!outbox->len)
+		return false;
+
+	ring_read(outbox->ring, 0, &hdr, sizeof(hdr));
+
+	if (hdr.len > outbox->record_size) {
+		outbox->record = l_realloc(outbox->record, hdr.len);
+		outbox->record_size = hdr.len;
+	}
+
+	ring_read(outbox->ring, sizeof(hdr), outbox->record,
+		  hdr.len - sizeof(hdr));
+
+	message->msg_type = hdr.msg_type;
+	message->priority = hdr.priority;
+	message->delivery_mode = hdr.delivery_mode;
+	message->expiration_ms = hdr.expiration_ms;
+
+	for (i = 0, offset = 0; i < OUTBOX_FIELDS_LENGTH; i++) {
+		*fields[i] = hdr.field_len[i] ?
+				(const char *) outbox->record + offset : NULL;
+		offset += hdr.field_len[i];
+	}
+
+	message->body_len = hdr.field_len[OUTBOX_FIELD_BODY] - 1;
+
+	return true;
+}
+
+/**
+ * outbox_pop:
+ * @outbox: buffer to remove from
+ *
+ * Removes the oldest message after it was successfully replayed.
+ */
+void outbox_pop(struct outbox *outbox)
+{
+	struct outbox_record hdr;
+
+	if (!outbox->len)
+		return;
+
+	ring_read(outbox->ring, 0, &hdr, sizeof(hdr));
+	l_ringbuf_drain(outbox->ring, hdr.len);
+	outbox->len--;
+	outbox->replayed++;
+}
+
+bool outbox_is_empty(struct outbox *outbox)
+{
+	return !outbox || !outbox->len;
+}
+
+void outbox_get_stats(struct outbox *outbox, mq_outbox_stats_t *stats)
+{
+	memset(stats, 0, sizeof(*stats));
+
+	if (!outbox)
+		return;
+
+	stats->len = outbox->len;
+	stats->buffered = outbox->buffered;
+	stats->dropped = outbox->dropped;
+	stats->replayed = outbox->replayed;
+}
@@ -0,0 +1,34 @@
+/*
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2020, CESAR. All rights reserved.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+/**
+ * Outbound message buffer header file
+ */
+
+struct outbox;
+
+struct outbox *outbox_new(size_t capacity, mq_outbox_policy policy);
+void outbox_free(struct outbox *outbox);
+int outbox_push(struct outbox *outbox, const mq_message_data_t *message);
+bool outbox_peek(struct outbox *outbox, mq_message_data_t *message);
+void outbox_pop(struct outbox *outbox);
+bool outbox_is_empty(struct outbox *outbox);
+void outbox_get_stats(struct outbox *outbox, mq_outbox_stats_t *stats);
@@ -19,6 +19,7 @@
 #endif
 
 #include <errno.h>
+#include <limits.h>
 #include <stdio.h>
 
 #include <ell/ell.h>
@@ -28,9 +29,11 @@
 
 #include <json-c/json.h>
 
+#include "knot_cloud.h"
 #include "parser.h"
-
-#define MIN(x, y) ((x) < (y) ? (x) : (y))
+#include "msgpack.h"
+#include "json_writer.h"
+#include "util.h"
 
 /*
  * TODO: consider moving this to knot-protocol
@@ -95,51 +98,74 @@ static int knot_value_as_int(const knot_value_type *data)
 	return data->val_i;
 }
 
-static const char *get_str_value_from_json(json_object *jso, const char *key)
+/* Kept from message to message, so that parsing doesn't allocate it */
+static json_tokener *tokener;
+
+/**
+ * parser_json_parse:
+ * @json_str: JSON document, which doesn't need to be NUL terminated
+ * @len: length of @json_str
+ *
+ * Parses a message received from the cloud once, so that its fields are
+ * all extracted from the same tree. The tokener is reused by every call
+ * until parser_stop().
+ *
+ * Returns: the tree to be released with json_object_put() or NULL if
+ * @json_str is not valid.
+ */
+json_object *parser_json_parse(const char *json_str, size_t len)
 {
-	const char *str_value;
-	json_object *jobjkey;
+	json_object *jobj;
 
-	if (!json_object_object_get_ex(jso, key, &jobjkey))
+	if (len > INT_MAX)
 		return NULL;
 
-	if (json_object_get_type(jobjkey) != json_type_string)
-		return NULL;
+	if (!tokener) {
+		tokener = json_tokener_new();
+		if (!tokener)
+			return NULL;
+	} else {
+		/* Drop whatever was left over by the previous message */
+		json_tokener_reset(tokener);
+	}
 
-	str_value = json_object_get_string(jobjkey);
+	jobj = json_tokener_parse_ex(tokener, json_str, len);
+	if (json_tokener_get_error(tokener) != json_tokener_success) {
+		json_object_put(jobj);
+		jobj = NULL;
+	}
 
-	return str_value;
+	return jobj;
 }
 
-static void *device_array_item(json_object *array_item,
-		create_device_item_cb cb)
+/**
+ * parser_stop:
+ *
+ * Releases the tokener kept by parser_json_parse().
+ */
+void parser_stop(void)
 {
-	json_object *jobjkey;
-	struct l_queue *config_list;
-	const char *id, *name;
+	if (!tokener)
+		return;
 
-	/* Getting 'Id': Mandatory field for registered device */
-	id = get_str_value_from_json(array_item, KNOT_JSON_FIELD_DEVICE_ID);
-	if (!id)
-		return NULL;
+	json_tokener_free(tokener);
+	tokener = NULL;
+}
 
-	/* Getting 'config': Mandatory field for registered device */
-	if (!json_object_object_get_ex(array_item,
-				       KNOT_JSON_FIELD_CONFIG, &jobjkey))
-		return NULL;
+static const char *get_str_value_from_json(json_object *jso, const char *key)
+{
+	const char *str_value;
+	json_object *jobjkey;
 
-	config_list = parser_config_to_list(
-					json_object_to_json_string(jobjkey));
-	if (!config_list)
+	if (!json_object_object_get_ex(jso, key, &jobjkey))
 		return NULL;
 
-	/* Getting 'Name' */
-	name = get_str_value_from_json(array_item,
-		KNOT_JSON_FIELD_DEVICE_NAME);
-	if (!name)
+	if (json_object_get_type(jobjkey) != json_type_string)
 		return NULL;
 
-	return cb(id, name, config_list);
+	str_value = json_object_get_string(jobjkey);
+
+	return str_value;
 }
 
 /*
@@ -190,57 +216,67 @@ static int parse_json2data(json_object *jobj, knot_value_type *kvalue)
 	return olen;
 }
 
-static json_object *parse_value_to_json(uint8_t value_type,
-					knot_value_type *value)
+static void write_value_json(struct json_writer *writer, uint8_t value_type,
+			     const knot_value_type *value)
 {
 	switch (value_type)
 	{
 	case KNOT_VALUE_TYPE_INT:
-		return json_object_new_int(value->val_i);
+		json_writer_int(writer, value->val_i);
+		break;
 	case KNOT_VALUE_TYPE_FLOAT:
-		return json_object_new_double(value->val_f);
+		json_writer_double(writer, value->val_f);
+		break;
 	case KNOT_VALUE_TYPE_BOOL:
-		return json_object_new_boolean(value->val_b);
+		json_writer_bool(writer, value->val_b);
+		break;
 	case KNOT_VALUE_TYPE_RAW:
-		return json_object_new_string(value->raw);
+		json_writer_str_len(writer, (const char *) value->raw,
+				    strnlen((const char *) value->raw,
+					    sizeof(value->raw)));
+		break;
 	case KNOT_VALUE_TYPE_INT64:
-		return json_object_new_int64(value->val_i64);
+		json_writer_int(writer, value->val_i64);
+		break;
 	case KNOT_VALUE_TYPE_UINT:
-		return json_object_new_uint64(value->val_u64);
 	case KNOT_VALUE_TYPE_UINT64:
-		return json_object_new_uint64(value->val_u64);
+		json_writer_uint(writer, value->val_u64);
+		break;
 	default:
+		json_writer_null(writer);
 		break;
 	}
 }
 
-static json_object *event_item_create_obj(knot_msg_config *config)
+static void event_item_write_json(struct json_writer *writer,
+				  const knot_msg_config *config)
 {
-	json_object *json_event;
+	json_writer_object_start(writer);
 
-	json_event = json_object_new_object();
+	if (config->event.event_flags & KNOT_EVT_FLAG_CHANGE) {
+		json_writer_key(writer, KNOT_JSON_FIELD_CHANGE);
+		json_writer_bool(writer, true);
+	}
 
-	if (config->event.event_flags & KNOT_EVT_FLAG_CHANGE)
-		json_object_object_add(json_event, KNOT_JSON_FIELD_CHANGE,
-				       json_object_new_boolean(true));
+	json_writer_key(writer, KNOT_JSON_FIELD_TIME_SEC);
+	json_writer_int(writer, config->event.time_sec);
 
-	json_object_object_add(json_event, KNOT_JSON_FIELD_TIME_SEC,
-			       json_object_new_int(config->event.time_sec));
+	if (config->event.event_flags & KNOT_EVT_FLAG_LOWER_THRESHOLD) {
+		json_writer_key(writer, KNOT_JSON_FIELD_LOWER_THRESHOLD);
+		write_value_json(writer, config->schema.value_type,
+				 &config->event.lower_limit);
+	}
 
-	if (config->event.event_flags & KNOT_EVT_FLAG_LOWER_THRESHOLD)
-		json_object_object_add(json_event,
-				KNOT_JSON_FIELD_LOWER_THRESHOLD,
-				parse_value_to_json(config->schema.value_type,
-						&config->event.lower_limit));
+	if (config->event.event_flags & KNOT_EVT_FLAG_UPPER_THRESHOLD) {
+		json_writer_key(writer, KNOT_JSON_FIELD_UPPER_THRESHOLD);
+		write_value_json(writer, config->schema.value_type,
+				 &config->event.upper_limit);
+	}
 
-	if (config->event.event_flags & KNOT_EVT_FLAG_UPPER_THRESHOLD)
-		json_object_object_add(json_event,
-				KNOT_JSON_FIELD_UPPER_THRESHOLD,
-				parse_value_to_json(config->schema.value_type,
-						&config->event.upper_limit));
+	json_writer_object_end(writer);
 
 	/*
-	 * Returned JSON object is in the following format:
+	 * Written JSON object is in the following format:
 	 *
 	 * {
 	 *   "change": true,
@@ -250,31 +286,28 @@ static json_object *event_item_create_obj(knot_msg_config *config)
 	 * }
 	 *
 	 */
-
-	return json_event;
 }
 
-static json_object *schema_item_create_obj(knot_msg_config *config)
+static void schema_item_write_json(struct json_writer *writer,
+				   const knot_msg_config *config)
 {
-	json_object *json_schema;
+	json_writer_object_start(writer);
 
-	json_schema = json_object_new_object();
+	json_writer_key(writer, KNOT_JSON_FIELD_VALUE_TYPE);
+	json_writer_int(writer, config->schema.value_type);
+	json_writer_key(writer, KNOT_JSON_FIELD_UNIT);
+	json_writer_int(writer, config->schema.unit);
+	json_writer_key(writer, KNOT_JSON_FIELD_TYPE_ID);
+	json_writer_int(writer, config->schema.type_id);
+	json_writer_key(writer, KNOT_JSON_FIELD_DEVICE_NAME);
+	json_writer_str_len(writer, config->schema.name,
+			    strnlen(config->schema.name,
+				    sizeof(config->schema.name)));
 
-	json_object_object_add(json_schema, KNOT_JSON_FIELD_VALUE_TYPE,
-				json_object_new_int(
-					config->schema.value_type));
-	json_object_object_add(json_schema, KNOT_JSON_FIELD_UNIT,
-				json_object_new_int(
-					config->schema.unit));
-	json_object_object_add(json_schema, KNOT_JSON_FIELD_TYPE_ID,
-				json_object_new_int(
-					config->schema.type_id));
-	json_object_object_add(json_schema, KNOT_JSON_FIELD_DEVICE_NAME,
-				json_object_new_string(
-					config->schema.name));
+	json_writer_object_end(writer);
 
 	/*
-	 * Returned JSON object is in the following format:
+	 * Written JSON object is in the following format:
 	 *
 	 * {
 	 *   "typeId": 0xFFF1,
@@ -284,28 +317,25 @@ static json_object *schema_item_create_obj(knot_msg_config *config)
 	 * }
 	 *
 	 */
-
-	return json_schema;
 }
 
-static void config_item_create_and_append(void *data, void *user_data)
+static void config_item_write_json(void *data, void *user_data)
 {
-	knot_msg_config *config = data;
-	json_object *config_array = user_data;
-	json_object *schema, *event, *config_obj;
+	const knot_msg_config *config = data;
+	struct json_writer *writer = user_data;
 
-	config_obj = json_object_new_object();
+	json_writer_object_start(writer);
 
-	json_object_object_add(config_obj, KNOT_JSON_FIELD_SENSOR_ID,
-			       json_object_new_int(config->sensor_id));
+	json_writer_key(writer, KNOT_JSON_FIELD_SENSOR_ID);
+	json_writer_int(writer, config->sensor_id);
 
-	schema = schema_item_create_obj(config);
-	json_object_object_add(config_obj, KNOT_JSON_FIELD_SCHEMA, schema);
+	json_writer_key(writer, KNOT_JSON_FIELD_SCHEMA);
+	schema_item_write_json(writer, config);
 
-	event = event_item_create_obj(config);
-	json_object_object_add(config_obj, KNOT_JSON_FIELD_EVENT, event);
+	json_writer_key(writer, KNOT_JSON_FIELD_EVENT);
+	event_item_write_json(writer, config);
 
-	json_object_array_add(config_array, config_obj);
+	json_writer_object_end(writer);
 }
 
 static int get_event(knot_event *event, json_object *data)
@@ -449,23 +479,32 @@ static int get_sensor_id(uint8_t *sensor_id, json_object *data)
 	return 0;
 }
 
-char *parser_config_create_object(const char *device_id,
-				  struct l_queue *config_list)
+/**
+ * parser_config_create_object:
+ * @writer: writer the message is written to, its previous content is
+ * discarded
+ * @device_id: device id
+ * @config_list: list of knot_msg_config
+ *
+ * Returns: the message, owned by @writer.
+ */
+const char *parser_config_create_object(struct json_writer *writer,
+					const char *device_id,
+					struct l_queue *config_list)
 {
-	char *json_str;
-	json_object *json_msg;
-	json_object *json_array;
+	json_writer_reset(writer);
 
-	json_msg = json_object_new_object();
+	json_writer_object_start(writer);
 
-	json_object_object_add(json_msg, KNOT_JSON_FIELD_DEVICE_ID,
-			       json_object_new_string(device_id));
+	json_writer_key(writer, KNOT_JSON_FIELD_DEVICE_ID);
+	json_writer_string(writer, device_id);
 
-	json_array = json_object_new_array();
-	l_queue_foreach(config_list, config_item_create_and_append,
-			json_array);
+	json_writer_key(writer, KNOT_JSON_FIELD_CONFIG);
+	json_writer_array_start(writer);
+	l_queue_foreach(config_list, config_item_write_json, writer);
+	json_writer_array_end(writer);
 
-	json_object_object_add(json_msg, KNOT_JSON_FIELD_CONFIG, json_array);
+	json_writer_object_end(writer);
 
 	/*
 	 * Returned JSON object is in the following format:
@@ -490,15 +529,11 @@ char *parser_config_create_object(const char *device_id,
 	 * }
 	 *
 	 */
-	json_str = l_strdup(json_object_to_json_string(json_msg));
-	json_object_put(json_msg);
-
-	return json_str;
+	return json_writer_str(writer);
 }
 
-struct l_queue *parser_update_to_list(const char *json_str)
+struct l_queue *parser_update_to_list(json_object *json_obj)
 {
-	json_object *json_obj;
 	json_object *json_array;
 	json_object *json_data;
 	json_object *jobjkey;
@@ -510,16 +545,11 @@ struct l_queue *parser_update_to_list(const char *json_str)
 	uint8_t sensor_id;
 	bool has_err;
 
-	json_obj = json_tokener_parse(json_str);
-	if (!json_obj)
-		return NULL;
-
 	list = l_queue_new();
 
 	if (!json_object_object_get_ex(json_obj, KNOT_JSON_FIELD_DATA,
 			&json_array)) {
 		l_queue_destroy(list, l_free);
-		json_object_put(json_obj);
 		return NULL;
 	}
 
@@ -580,7 +610,7 @@ struct l_queue *parser_update_to_list(const char *json_str)
 			break;
 		}
 	}
-	json_object_put(json_obj);
+
 	if (has_err) {
 		l_queue_destroy(list, l_free);
 		return NULL;
@@ -589,76 +619,267 @@ struct l_queue *parser_update_to_list(const char *json_str)
 	return list;
 }
 
-char *parser_data_create_object(const char *device_id, uint8_t sensor_id,
-				       uint8_t value_type,
-				       const knot_value_type *value,
-				       uint8_t kval_len)
+/*
+ * Moves @reader to the value of @key in the map it points to.
+ */
+static bool msgpack_find_key(struct msgpack_reader *reader, const char *key)
 {
-	char *json_str;
-	json_object *json_msg;
-	json_object *data;
-	json_object *json_array;
+	const char *name;
+	uint32_t name_len;
+	uint32_t n;
+
+	if (!msgpack_read_map(reader, &n))
+		return false;
+
+	while (n--) {
+		if (!msgpack_read_str(reader, &name, &name_len))
+			return false;
+
+		if (name_len == strlen(key) && !memcmp(name, key, name_len))
+			return true;
+
+		if (!msgpack_skip(reader))
+			return false;
+	}
+
+	return false;
+}
+
+/*
+ * Parsing knot_value_type attribute, the counterpart of parse_json2data()
+ */
+static int parse_msgpack2data(struct msgpack_reader *reader,
+			      knot_value_type *kvalue)
+{
+	const void *bin;
+	uint32_t bin_len;
+	int64_t i64;
+	double f;
+
+	switch (msgpack_peek_type(reader)) {
+	case MSGPACK_TYPE_BOOL:
+		if (!msgpack_read_bool(reader, &kvalue->val_b))
+			return 0;
+		return sizeof(kvalue->val_b);
+	case MSGPACK_TYPE_FLOAT:
+		if (!msgpack_read_double(reader, &f))
+			return 0;
+		kvalue->val_f = (float) f;
+		return sizeof(kvalue->val_f);
+	case MSGPACK_TYPE_INT:
+	case MSGPACK_TYPE_UINT:
+		if (!msgpack_read_int(reader, &i64))
+			return 0;
+		kvalue->val_i = i64;
+		return sizeof(kvalue->val_i);
+	case MSGPACK_TYPE_BIN:
+		/* Raw values don't go through base64 */
+		if (!msgpack_read_bin(reader, &bin, &bin_len))
+			return 0;
+		bin_len = MIN(bin_len, KNOT_DATA_RAW_SIZE); /* truncate */
+		memcpy(kvalue->raw, bin, bin_len);
+		return bin_len;
+	case MSGPACK_TYPE_NIL:
+	case MSGPACK_TYPE_STR:
+	case MSGPACK_TYPE_ARRAY:
+	case MSGPACK_TYPE_MAP:
+	case MSGPACK_TYPE_INVALID:
+	default:
+		return 0;
+	}
+}
+
+static knot_msg_data *msgpack_data_item(struct msgpack_reader *reader)
+{
+	knot_msg_data *msg;
+	const char *key;
+	uint32_t key_len;
+	uint32_t n;
+	int64_t sensor_id = -1;
+	int olen = 0;
+
+	if (!msgpack_read_map(reader, &n))
+		return NULL;
+
+	msg = l_new(knot_msg_data, 1);
+
+	while (n--) {
+		if (!msgpack_read_str(reader, &key, &key_len))
+			goto fail;
+
+		if (key_len == strlen(KNOT_JSON_FIELD_SENSOR_ID) &&
+		    !memcmp(key, KNOT_JSON_FIELD_SENSOR_ID, key_len)) {
+			if (!msgpack_read_int(reader, &sensor_id))
+				goto fail;
+		} else if (key_len == strlen(KNOT_JSON_FIELD_VALUE) &&
+			   !memcmp(key, KNOT_JSON_FIELD_VALUE, key_len)) {
+			olen = parse_msgpack2data(reader, &msg->payload);
+			if (olen <= 0)
+				goto fail;
+		} else if (!msgpack_skip(reader)) {
+			goto fail;
+		}
+	}
+
+	if (sensor_id < 0 || sensor_id > UINT8_MAX || olen <= 0)
+		goto fail;
+
+	msg->sensor_id = sensor_id;
+	msg->hdr.type = KNOT_MSG_PUSH_DATA_REQ;
+	msg->hdr.payload_len = olen + sizeof(msg->sensor_id);
+
+	return msg;
+
+fail:
+	l_free(msg);
+	return NULL;
+}
+
+/**
+ * parser_update_msgpack_to_list:
+ * @buf: MessagePack encoded update message
+ * @len: length of @buf
+ *
+ * Decodes an update message with the same fields as the JSON one parsed
+ * by parser_update_to_list().
+ *
+ * Returns: list of knot_msg_data or NULL if the message is malformed.
+ */
+struct l_queue *parser_update_msgpack_to_list(const void *buf, size_t len)
+{
+	struct msgpack_reader reader;
+	struct l_queue *list;
+	knot_msg_data *msg;
+	uint32_t n;
+
+	msgpack_reader_init(&reader, buf, len);
+
+	if (!msgpack_find_key(&reader, KNOT_JSON_FIELD_DATA))
+		return NULL;
+
+	if (!msgpack_read_array(&reader, &n))
+		return NULL;
+
+	list = l_queue_new();
+
+	while (n--) {
+		msg = msgpack_data_item(&reader);
+		if (!msg) {
+			l_queue_destroy(list, l_free);
+			return NULL;
+		}
+
+		l_queue_push_tail(list, msg);
+	}
+
+	return list;
+}
+
+static bool data_item_write_json(struct json_writer *writer,
+				 const struct knot_cloud_sample *sample)
+{
+	const knot_value_type *kvalue = &sample->value;
 	char *encoded;
 	size_t encoded_len;
-	bool has_err;
 
-	json_msg = json_object_new_object();
-	json_array = json_object_new_array();
+	json_writer_object_start(writer);
 
-	json_object_object_add(json_msg, KNOT_JSON_FIELD_DEVICE_ID,
-			       json_object_new_string(device_id));
-	data = json_object_new_object();
-	json_object_object_add(data, KNOT_JSON_FIELD_SENSOR_ID,
-			       json_object_new_int(sensor_id));
+	json_writer_key(writer, KNOT_JSON_FIELD_SENSOR_ID);
+	json_writer_int(writer, sample->sensor_id);
 
-	has_err = false;
-	switch (value_type) {
+	json_writer_key(writer, KNOT_JSON_FIELD_VALUE);
+
+	switch (sample->value_type) {
 	case KNOT_VALUE_TYPE_INT:
-		json_object_object_add(data, KNOT_JSON_FIELD_VALUE,
-				json_object_new_int(knot_value_as_int(value)));
+		json_writer_int(writer, knot_value_as_int(kvalue));
 		break;
 	case KNOT_VALUE_TYPE_FLOAT:
-		json_object_object_add(data, KNOT_JSON_FIELD_VALUE,
-			json_object_new_double(knot_value_as_double(value)));
+		json_writer_double(writer, knot_value_as_double(kvalue));
 		break;
 	case KNOT_VALUE_TYPE_BOOL:
-		json_object_object_add(data, KNOT_JSON_FIELD_VALUE,
-			json_object_new_boolean(knot_value_as_boolean(value)));
+		json_writer_bool(writer, knot_value_as_boolean(kvalue));
 		break;
 	case KNOT_VALUE_TYPE_RAW:
 		/* Encode as base64 */
-		encoded = knot_value_as_raw(value, kval_len, &encoded_len);
-		if (!encoded) {
-			has_err = true;
-			json_object_put(json_array);
-			json_object_put(data);
-			break;
-		}
-		json_object_object_add(data, KNOT_JSON_FIELD_VALUE,
-			json_object_new_string_len(encoded, encoded_len));
+		encoded = knot_value_as_raw(kvalue, sample->kval_len,
+					    &encoded_len);
+		if (!encoded)
+			return false;
+		json_writer_str_len(writer, encoded, encoded_len);
+		l_free(encoded);
 		break;
 	case KNOT_VALUE_TYPE_INT64:
-		json_object_object_add(data, KNOT_JSON_FIELD_VALUE,
-			json_object_new_int64(knot_value_as_int64(value)));
+		json_writer_int(writer, knot_value_as_int64(kvalue));
 		break;
 	case KNOT_VALUE_TYPE_UINT:
-		json_object_object_add(data, KNOT_JSON_FIELD_VALUE,
-			json_object_new_uint64(knot_value_as_uint(value)));
+		json_writer_uint(writer, knot_value_as_uint(kvalue));
 		break;
 	case KNOT_VALUE_TYPE_UINT64:
-		json_object_object_add(data, KNOT_JSON_FIELD_VALUE,
-			json_object_new_uint64(knot_value_as_uint64(value)));
+		json_writer_uint(writer, knot_value_as_uint64(kvalue));
 		break;
 	default:
-		has_err = true;
-		break;
+		return false;
 	}
-	json_object_array_add(json_array, data);
-	json_object_object_add(json_msg, KNOT_JSON_FIELD_DATA, json_array);
-	if (!has_err) {
-		json_str = l_strdup(json_object_to_json_string(json_msg));
+
+	json_writer_object_end(writer);
+
+	return true;
+}
+
+const char *parser_data_create_object(struct json_writer *writer,
+				      const char *device_id,
+				      uint8_t sensor_id, uint8_t value_type,
+				      const knot_value_type *value,
+				      uint8_t kval_len)
+{
+	struct knot_cloud_sample sample = {
+		.sensor_id = sensor_id,
+		.value_type = value_type,
+		.value = *value,
+		.kval_len = kval_len
+	};
+
+	return parser_data_batch_create_object(writer, device_id, &sample, 1);
+}
+
+/**
+ * parser_data_batch_create_object:
+ * @writer: writer the message is written to, its previous content is
+ * discarded
+ * @device_id: device id
+ * @samples: readings of the device
+ * @num_samples: number of @samples
+ *
+ * Returns: the message, owned by @writer, or NULL if a sample is not valid.
+ */
+const char *parser_data_batch_create_object(struct json_writer *writer,
+				const char *device_id,
+				const struct knot_cloud_sample *samples,
+				size_t num_samples)
+{
+	size_t i;
+
+	if (!num_samples)
+		return NULL;
+
+	json_writer_reset(writer);
+
+	json_writer_object_start(writer);
+
+	json_writer_key(writer, KNOT_JSON_FIELD_DEVICE_ID);
+	json_writer_string(writer, device_id);
+
+	json_writer_key(writer, KNOT_JSON_FIELD_DATA);
+	json_writer_array_start(writer);
+
+	for (i = 0; i < num_samples; i++) {
+		if (!data_item_write_json(writer, &samples[i]))
+			return NULL;
 	}
-	json_object_put(json_msg);
+
+	json_writer_array_end(writer);
+	json_writer_object_end(writer);
+
 	/*
 	 * Returned JSON object is in the following format:
 	 *
@@ -666,32 +887,113 @@ char *parser_data_create_object(const char *device_id, uint8_t sensor_id,
 	 *   "data": [{
 	 *     "sensorId": 1,
 	 *     "value": false,
+	 *   }, {
+	 *     "sensorId": 2,
+	 *     "value": 1000,
 	 *   }]
 	 * }
 	 */
+	return json_writer_str(writer);
+}
+
+static bool data_item_write_msgpack(struct msgpack_writer *writer,
+				    const struct knot_cloud_sample *sample)
+{
+	const knot_value_type *kvalue = &sample->value;
+
+	msgpack_write_map(writer, 2);
+	msgpack_write_str(writer, KNOT_JSON_FIELD_SENSOR_ID);
+	msgpack_write_uint(writer, sample->sensor_id);
+	msgpack_write_str(writer, KNOT_JSON_FIELD_VALUE);
+
+	switch (sample->value_type) {
+	case KNOT_VALUE_TYPE_INT:
+		msgpack_write_int(writer, knot_value_as_int(kvalue));
+		break;
+	case KNOT_VALUE_TYPE_FLOAT:
+		msgpack_write_float(writer, kvalue->val_f);
+		break;
+	case KNOT_VALUE_TYPE_BOOL:
+		msgpack_write_bool(writer, knot_value_as_boolean(kvalue));
+		break;
+	case KNOT_VALUE_TYPE_RAW:
+		/* Sent as is, without the base64 expansion */
+		msgpack_write_bin(writer, kvalue->raw,
+				  MIN(sample->kval_len, KNOT_DATA_RAW_SIZE));
+		break;
+	case KNOT_VALUE_TYPE_INT64:
+		msgpack_write_int(writer, knot_value_as_int64(kvalue));
+		break;
+	case KNOT_VALUE_TYPE_UINT:
+		msgpack_write_uint(writer, knot_value_as_uint(kvalue));
+		break;
+	case KNOT_VALUE_TYPE_UINT64:
+		msgpack_write_uint(writer, knot_value_as_uint64(kvalue));
+		break;
+	default:
+		return false;
+	}
 
-	return (json_str && !has_err) ? json_str : NULL;
+	return true;
 }
 
-struct l_queue *parser_config_to_list(const char *json_str)
+/**
+ * parser_data_batch_create_msgpack:
+ * @device_id: device id
+ * @samples: readings to be encoded
+ * @num_samples: number of items in @samples
+ * @len: filled with the length of the encoded message
+ *
+ * Encodes a data message with the same fields as the JSON one created by
+ * parser_data_batch_create_object().
+ *
+ * Returns: the encoded message, to be freed with l_free(), or NULL if a
+ * value type is unknown.
+ */
+char *parser_data_batch_create_msgpack(const char *device_id,
+				       const struct knot_cloud_sample *samples,
+				       size_t num_samples, size_t *len)
+{
+	struct msgpack_writer writer;
+	size_t i;
+
+	if (!num_samples)
+		return NULL;
+
+	/* Room for the device id and most readings without growing */
+	msgpack_writer_init(&writer, 64 + num_samples * 24);
+
+	msgpack_write_map(&writer, 2);
+	msgpack_write_str(&writer, KNOT_JSON_FIELD_DEVICE_ID);
+	msgpack_write_str(&writer, device_id);
+	msgpack_write_str(&writer, KNOT_JSON_FIELD_DATA);
+	msgpack_write_array(&writer, num_samples);
+
+	for (i = 0; i < num_samples; i++) {
+		if (!data_item_write_msgpack(&writer, &samples[i])) {
+			l_free(msgpack_writer_finish(&writer, len));
+			return NULL;
+		}
+	}
+
+	return (char *) msgpack_writer_finish(&writer, len);
+}
+
+/*
+ * Walks a config array in place, such as the one of each device listed by
+ * the cloud, which is already part of a parsed tree.
+ */
+static struct l_queue *config_array_to_list(json_object *jobjarray)
 {
-	json_object *jobjconfig, *jobjarray, *jobjentry;
+	json_object *jobjentry;
 	struct l_queue *list;
 	knot_msg_config *config;
 	uint64_t i;
-	const char *name;
 	bool err;
 
-	jobjconfig = json_tokener_parse(json_str);
-	if (!jobjconfig)
+	if (json_object_get_type(jobjarray) != json_type_array)
 		return NULL;
 
-	if (!json_object_object_get_ex(jobjconfig, KNOT_JSON_FIELD_CONFIG,
-				       &jobjarray)) {
-		json_object_put(jobjconfig);
-		return NULL;
-	}
-
 	list = l_queue_new();
 	err = false;
 
@@ -728,26 +1030,62 @@ struct l_queue *parser_config_to_list(const char *json_str)
 	if (err) {
 		l_free(config);
 		l_queue_destroy(list, l_free);
-		json_object_put(jobjarray);
 		return NULL;
 	}
 
 	return list;
 }
 
-struct l_queue *parser_queue_from_json_array(const char *json_str,
+struct l_queue *parser_config_to_list(json_object *jobjconfig)
+{
+	json_object *jobjarray;
+
+	if (!json_object_object_get_ex(jobjconfig, KNOT_JSON_FIELD_CONFIG,
+				       &jobjarray))
+		return NULL;
+
+	return config_array_to_list(jobjarray);
+}
+
+static void *device_array_item(json_object *array_item,
+		create_device_item_cb cb)
+{
+	json_object *jobjkey;
+	struct l_queue *config_list;
+	const char *id, *name;
+
+	/* Getting 'Id': Mandatory field for registered device */
+	id = get_str_value_from_json(array_item, KNOT_JSON_FIELD_DEVICE_ID);
+	if (!id)
+		return NULL;
+
+	/* Getting 'Name' */
+	name = get_str_value_from_json(array_item,
+		KNOT_JSON_FIELD_DEVICE_NAME);
+	if (!name)
+		return NULL;
+
+	/* Getting 'config': Mandatory field for registered device */
+	if (!json_object_object_get_ex(array_item,
+				       KNOT_JSON_FIELD_CONFIG, &jobjkey))
+		return NULL;
+
+	config_list = config_array_to_list(jobjkey);
+	if (!config_list)
+		return NULL;
+
+	return cb(id, name, config_list);
+}
+
+struct l_queue *parser_queue_from_json_array(json_object *jobj,
 					     create_device_item_cb item_cb)
 {
-	json_object *jobj, *jobjentry, *jarray;
+	json_object *jobjentry, *jarray;
 	struct l_queue *list;
 	void *item;
-	int len;
+	int num_devices;
 	int i;
 
-	jobj = json_tokener_parse(json_str);
-	if (!jobj)
-		return NULL;
-
 	jarray = json_object_object_get(jobj, KNOT_JSON_FIELD_DEVICES);
 	if (!jarray)
 		return NULL;
@@ -755,23 +1093,21 @@ struct l_queue *parser_queue_from_json_array(const char *json_str,
 	if (json_object_get_type(jarray) != json_type_array)
 		return NULL;
 
-	len = json_object_array_length(jarray);
+	num_devices = json_object_array_length(jarray);
 	list = l_queue_new();
 
-	for (i = 0; i < len; i++) {
+	for (i = 0; i < num_devices; i++) {
 		jobjentry = json_object_array_get_idx(jarray, i);
 		item = device_array_item(jobjentry, item_cb);
 		if (item)
 			l_queue_push_tail(list, item);
 	}
-	json_object_put(jobj);
 
 	return list;
 }
 
-struct l_queue *parser_request_to_list(const char *json_str)
+struct l_queue *parser_request_to_list(json_object *jso)
 {
-	json_object *jso;
 	struct l_queue *list;
 	json_object *json_array;
 	json_object *jobjentry;
@@ -779,9 +1115,6 @@ struct l_queue *parser_request_to_list(const char *json_str)
 	uint64_t i;
 	bool has_err;
 
-	jso = json_tokener_parse(json_str);
-	if (!jso)
-		return NULL;
 	list = l_queue_new();
 
 	if (!json_object_object_get_ex(jso, KNOT_JSON_FIELD_SENSOR_IDS,
@@ -846,20 +1179,18 @@ char *parser_sensorid_to_json(const char *key, struct l_queue *list)
 	return json_str;
 }
 
-char *parser_device_json_create(const char *device_id,
-			const char *device_name)
+const char *parser_device_json_create(struct json_writer *writer,
+				     const char *device_id,
+				     const char *device_name)
 {
-	char *json_str;
-	json_object *device;
+	json_writer_reset(writer);
 
-	device = json_object_new_object();
-	if (!device)
-		return NULL;
-
-	json_object_object_add(device, KNOT_JSON_FIELD_DEVICE_NAME,
-			json_object_new_string(device_name));
-	json_object_object_add(device, KNOT_JSON_FIELD_DEVICE_ID,
-			json_object_new_string(device_id));
+	json_writer_object_start(writer);
+	json_writer_key(writer, KNOT_JSON_FIELD_DEVICE_NAME);
+	json_writer_string(writer, device_name);
+	json_writer_key(writer, KNOT_JSON_FIELD_DEVICE_ID);
+	json_writer_string(writer, device_id);
+	json_writer_object_end(writer);
 
 	/*
 	 * Returned JSON object is in the following format:
@@ -868,27 +1199,21 @@ char *parser_device_json_create(const char *device_id,
 	 *   "name": "KNoT Thing"
 	 * }
 	 */
-	json_str = l_strdup(json_object_to_json_string(device));
-	json_object_put(device);
-
-	return json_str;
+	return json_writer_str(writer);
 }
 
-char *parser_auth_json_create(const char *device_id,
-			const char *device_token)
+const char *parser_auth_json_create(struct json_writer *writer,
+				   const char *device_id,
+				   const char *device_token)
 {
-	char *json_str;
-	json_object *auth;
-
-	auth = json_object_new_object();
-	if (!auth)
-		return NULL;
-
-	json_object_object_add(auth, KNOT_JSON_FIELD_DEVICE_ID,
-			       json_object_new_string(device_id));
-	json_object_object_add(auth, KNOT_JSON_FIELD_DEVICE_TOKEN,
-			       json_object_new_string(device_token));
+	json_writer_reset(writer);
 
+	json_writer_object_start(writer);
+	json_writer_key(writer, KNOT_JSON_FIELD_DEVICE_ID);
+	json_writer_string(writer, device_id);
+	json_writer_key(writer, KNOT_JSON_FIELD_DEVICE_TOKEN);
+	json_writer_string(writer, device_token);
+	json_writer_object_end(writer);
 
 	/*
 	 * Returned JSON object is in the following format:
@@ -897,73 +1222,73 @@ char *parser_auth_json_create(const char *device_id,
 	 *   "token": "0c20c12e2ac058d0513d81dc58e33b2f9ff8c83d"
 	 * }
 	 */
-	json_str = l_strdup(json_object_to_json_string(auth));
-	json_object_put(auth);
-
-	return json_str;
+	return json_writer_str(writer);
 }
 
-char *parser_unregister_json_create(const char *device_id)
+const char *parser_unregister_json_create(struct json_writer *writer,
+					  const char *device_id)
 {
-	char *json_str;
-	json_object *unreg;
-
-	unreg = json_object_new_object();
-	if (!unreg)
-		return NULL;
+	json_writer_reset(writer);
 
-	json_object_object_add(unreg, KNOT_JSON_FIELD_DEVICE_ID,
-			       json_object_new_string(device_id));
+	json_writer_object_start(writer);
+	json_writer_key(writer, KNOT_JSON_FIELD_DEVICE_ID);
+	json_writer_string(writer, device_id);
+	json_writer_object_end(writer);
 
 	/*
 	 * Returned JSON object is in the following format:
 	 *
 	 * { "id": "fbe64efa6c7f717e" }
 	 */
-	json_str = l_strdup(json_object_to_json_string(unreg));
-	json_object_put(unreg);
-
-	return json_str;
+	return json_writer_str(writer);
 }
 
-char *parser_get_key_str_from_json_str(const char *json_str,
-				       const char *key)
+char *parser_get_key_str_from_json(json_object *jso, const char *key)
 {
-	char *str_key;
-	json_object *jso;
-	json_object *jobjkey;
-
-	jso = json_tokener_parse(json_str);
-	if (!jso)
-		return NULL;
-
-	if (!json_object_object_get_ex(jso, key, &jobjkey))
-		return NULL;
+	const char *str_value;
 
-	if (json_object_get_type(jobjkey) != json_type_string)
+	str_value = get_str_value_from_json(jso, key);
+	if (!str_value)
 		return NULL;
 
-	str_key = l_strdup(json_object_get_string(jobjkey));
-	json_object_put(jso);
-
-	return str_key;
+	return l_strdup(str_value);
 }
 
-bool parser_is_key_str_or_null(const char *json_str, const char *key)
+bool parser_is_key_str_or_null(json_object *jso, const char *key)
 {
-	json_object *jso;
 	json_object *jobjkey;
 	enum json_type type;
 
-	jso = json_tokener_parse(json_str);
-	if (!jso)
-		return false;
-
 	if (!json_object_object_get_ex(jso, key, &jobjkey))
 		return false;
 
 	type = json_object_get_type(jobjkey);
-	json_object_put(jso);
 
 	return type == json_type_string || type == json_type_null;
 }
+
+/**
+ * parser_get_key_str_from_msgpack:
+ * @buf: MessagePack encoded message
+ * @len: length of @buf
+ * @key: key of the string in the top level map
+ *
+ * Returns: a copy of the string or NULL if @key isn't a string.
+ */
+char *parser_get_key_str_from_msgpack(const void *buf, size_t len,
+				      const char *key)
+{
+	struct msgpack_reader reader;
+	const char *str;
+	uint32_t str_len;
+
+	msgpack_reader_init(&reader, buf, len);
+
+	if (!msgpack_find_key(&reader, key))
+		return NULL;
+
+	if (!msgpack_read_str(&reader, &str, &str_len))
+		return NULL;
+
+	return l_strndup(str, str_len);
+}
@@ -35,26 +35,46 @@
 #define KNOT_JSON_FIELD_LOWER_THRESHOLD	"lowerThreshold"
 #define KNOT_JSON_FIELD_UPPER_THRESHOLD	"upperThreshold"
 
+struct knot_cloud_sample;
+struct json_object;
+struct json_writer;
+
 typedef void *(create_device_item_cb) (const char *id, const char *name,
 				       struct l_queue *schema);
 
-char *parser_config_create_object(const char *device_id,
-					 struct l_queue *config_list);
-struct l_queue *parser_update_to_list(const char *json_str);
-char *parser_data_create_object(const char *device_id, uint8_t sensor_id,
-				uint8_t value_type,
-				const knot_value_type *value,
-				uint8_t kval_len);
-struct l_queue *parser_config_to_list(const char *json_str);
-struct l_queue *parser_queue_from_json_array(const char *json_str,
+const char *parser_config_create_object(struct json_writer *writer,
+					const char *device_id,
+					struct l_queue *config_list);
+struct json_object *parser_json_parse(const char *json_str, size_t len);
+void parser_stop(void);
+struct l_queue *parser_update_to_list(struct json_object *jso);
+struct l_queue *parser_update_msgpack_to_list(const void *buf, size_t len);
+const char *parser_data_create_object(struct json_writer *writer,
+				      const char *device_id,
+				      uint8_t sensor_id, uint8_t value_type,
+				      const knot_value_type *value,
+				      uint8_t kval_len);
+const char *parser_data_batch_create_object(struct json_writer *writer,
+				const char *device_id,
+				const struct knot_cloud_sample *samples,
+				size_t num_samples);
+char *parser_data_batch_create_msgpack(const char *device_id,
+				       const struct knot_cloud_sample *samples,
+				       size_t num_samples, size_t *len);
+struct l_queue *parser_config_to_list(struct json_object *jso);
+struct l_queue *parser_queue_from_json_array(struct json_object *jso,
 					     create_device_item_cb item_cb);
-struct l_queue *parser_request_to_list(const char *json_str);
+struct l_queue *parser_request_to_list(struct json_object *jso);
 char *parser_sensorid_to_json(const char *key, struct l_queue *list);
-char *parser_device_json_create(const char *device_id,
-				       const char *device_name);
-char *parser_auth_json_create(const char *device_id,
-				     const char *device_token);
-char *parser_unregister_json_create(const char *device_id);
-char *parser_get_key_str_from_json_str(const char *json_str,
-				       const char *key);
-bool parser_is_key_str_or_null(const char *json_str, const char *key);
+const char *parser_device_json_create(struct json_writer *writer,
+				     const char *device_id,
+				     const char *device_name);
+const char *parser_auth_json_create(struct json_writer *writer,
+				   const char *device_id,
+				   const char *device_token);
+const char *parser_unregister_json_create(struct json_writer *writer,
+					  const char *device_id);
+char *parser_get_key_str_from_json(struct json_object *jso, const char *key);
+bool parser_is_key_str_or_null(struct json_object *jso, const char *key);
+char *parser_get_key_str_from_msgpack(const void *buf, size_t len,
+				      const char *key);
@@ -0,0 +1,773 @@
+/*
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2020, CESAR. All rights reserved.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+/**
+ * Persistent outbound message spool source file
+ *
+ * Messages are appended to fixed size segment files mapped in memory, so
+ * they survive a restart of the process. A cursor file, also mapped, holds
+ * the position of the first message not yet confirmed by the broker.
+ * Segments behind the cursor are removed.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <ell/ell.h>
+
+#include "mq.h"
+#include "spool.h"
+
+/* Bumped whenever the record layout changes, kept in the magic low byte */
+#define SPOOL_FORMAT_VERSION 3
+#define SPOOL_RECORD_MAGIC_BASE 0x4B4E4F00
+#define SPOOL_RECORD_MAGIC (SPOOL_RECORD_MAGIC_BASE | SPOOL_FORMAT_VERSION)
+#define SPOOL_CURSOR_MAGIC 0x4B435552
+#define SPOOL_CURSOR_FILE "cursor"
+#define SPOOL_SEGMENT_SUFFIX ".seg"
+#define SPOOL_SYNC_INTERVAL_MS 1000
+
+#define SPOOL_ALIGN(len) (((len) + 7) & ~((size_t) 7))
+
+enum spool_field {
+	SPOOL_FIELD_EXCHANGE,
+	SPOOL_FIELD_ROUTING_KEY,
+	SPOOL_FIELD_BODY,
+	SPOOL_FIELD_REPLY_TO,
+	SPOOL_FIELD_CORRELATION_ID,
+	SPOOL_FIELD_CONTENT_TYPE,
+	SPOOL_FIELD_CONTENT_ENCODING,
+	SPOOL_FIELDS_LENGTH
+};
+
+struct spool_record {
+	uint32_t magic; /* Written last, a record is valid once it is set */
+	uint32_t len; /* Length of the whole record, aligned */
+	uint32_t checksum; /* Of the strings following the header */
+	uint16_t msg_type;
+	uint8_t priority;
+	uint8_t delivery_mode;
+	uint64_t expiration_ms;
+	/* Field lengths including the terminator, 0 if NULL */
+	uint32_t field_len[SPOOL_FIELDS_LENGTH];
+};
+
+struct spool_position {
+	uint32_t segment;
+	uint32_t offset;
+};
+
+struct spool_cursor {
+	uint32_t magic;
+	struct spool_position committed;
+};
+
+struct spool_segment {
+	uint32_t id;
+	int fd;
+	size_t size;
+	void *map;
+};
+
+struct spool_inflight {
+	unsigned int seq;
+	struct spool_position next;
+	bool acked;
+};
+
+struct spool {
+	char *path;
+	size_t segment_size;
+	struct spool_segment writer;
+	struct spool_segment reader;
+	struct spool_position write_pos;
+	struct spool_position read_pos;
+	int cursor_fd;
+	struct spool_cursor *cursor;
+	struct l_queue *inflight;
+	unsigned int next_seq;
+	size_t dirty_start;
+	size_t dirty_end;
+	bool cursor_dirty;
+	struct l_timeout *sync_timeout;
+};
+
+static uint32_t checksum(const uint8_t *data, size_t len)
+{
+	uint32_t hash = 2166136261U; /* FNV-1a */
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		hash ^= data[i];
+		hash *= 16777619U;
+	}
+
+	return hash;
+}
+
+static bool position_equal(const struct spool_position *a,
+			   const struct spool_position *b)
+{
+	return a->segment == b->segment && a->offset == b->offset;
+}
+
+static void segment_path(const struct spool *spool, uint32_t id,
+			 char *path, size_t len)
+{
+	snprintf(path, len, "%s/%010u%s", spool->path, id,
+		 SPOOL_SEGMENT_SUFFIX);
+}
+
+static void segment_unmap(struct spool_segment *segment)
+{
+	if (!segment->map)
+		return;
+
+	munmap(segment->map, segment->size);
+	close(segment->fd);
+	segment->map = NULL;
+	segment->fd = -1;
+}
+
+static int segment_map(struct spool *spool, struct spool_segment *segment,
+		       uint32_t id, bool create)
+{
+	char path[PATH_MAX];
+	struct stat st;
+	int fd, err;
+
+	segment_path(spool, id, path, sizeof(path));
+
+	fd = open(path, O_RDWR | O_CLOEXEC | (create ? O_CREAT : 0), 0600);
+	if (fd < 0)
+		return -errno;
+
+	if (create && ftruncate(fd, spool->segment_size) < 0)
+		goto fail;
+
+	if (fstat(fd, &st) < 0)
+		goto fail;
+
+	segment->map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE,
+			    MAP_SHARED, fd, 0);
+	if (segment->map == MAP_FAILED) {
+		segment->map = NULL;
+		goto fail;
+	}
+
+	segment->id = id;
+	segment->fd = fd;
+	segment->size = st.st_size;
+
+	return 0;
+
+fail:
+	err = -errno;
+	close(fd);
+	return err;
+}
+
+static void segment_remove(struct spool *spool, uint32_t id)
+{
+	char path[PATH_MAX];
+
+	if (spool->reader.map && spool->reader.id == id)
+		segment_unmap(&spool->reader);
+
+	segment_path(spool, id, path, sizeof(path));
+	unlink(path);
+}
+
+static const struct spool_record *record_at(
+					const struct spool_segment *segment,
+					uint32_t offset)
+{
+	const struct spool_record *record;
+
+	if (offset + sizeof(*record) > segment->size)
+		return NULL;
+
+	record = (const void *) ((const uint8_t *) segment->map + offset);
+	if (record->magic != SPOOL_RECORD_MAGIC ||
+	    record->len < sizeof(*record) ||
+	    offset + record->len > segment->size)
+		return NULL;
+
+	return record;
+}
+
+static bool record_is_intact(const struct spool_record *record)
+{
+	size_t len = sizeof(*record);
+	int i;
+
+	for (i = 0; i < SPOOL_FIELDS_LENGTH; i++)
+		len += record->field_len[i];
+
+	if (SPOOL_ALIGN(len) != record->len)
+		return false;
+
+	return record->checksum == checksum((const uint8_t *) (record + 1),
+					    len - sizeof(*record));
+}
+
+static struct spool_segment *reader_segment(struct spool *spool, uint32_t id)
+{
+	if (id == spool->writer.id)
+		return &spool->writer;
+
+	if (spool->reader.map && spool->reader.id == id)
+		return &spool->reader;
+
+	segment_unmap(&spool->reader);
+
+	if (segment_map(spool, &spool->reader, id, false) < 0)
+		return NULL;
+
+	return &spool->reader;
+}
+
+/* Segments are never reused, so the first record tells their format */
+static bool segment_is_outdated(struct spool *spool, uint32_t id)
+{
+	const struct spool_segment *segment = reader_segment(spool, id);
+	uint32_t magic;
+
+	if (!segment || segment->size < sizeof(magic))
+		return false;
+
+	memcpy(&magic, segment->map, sizeof(magic));
+
+	return (magic & ~0xFFU) == SPOOL_RECORD_MAGIC_BASE &&
+	       magic != SPOOL_RECORD_MAGIC;
+}
+
+static void spool_sync(struct spool *spool)
+{
+	long page_size = sysconf(_SC_PAGESIZE);
+	size_t start;
+
+	if (spool->dirty_end > spool->dirty_start) {
+		start = spool->dirty_start & ~((size_t) page_size - 1);
+		if (msync((uint8_t *) spool->writer.map + start,
+			  spool->dirty_end - start, MS_SYNC) < 0)
+			l_error("Failed to sync spool segment: %s",
+				strerror(errno));
+
+		spool->dirty_start = spool->dirty_end = 0;
+	}
+
+	if (spool->cursor_dirty) {
+		if (msync(spool->cursor, sizeof(*spool->cursor), MS_SYNC) < 0)
+			l_error("Failed to sync spool cursor: %s",
+				strerror(errno));
+
+		spool->cursor_dirty = false;
+	}
+}
+
+static void on_sync_timeout(struct l_timeout *timeout, void *user_data)
+{
+	struct spool *spool = user_data;
+
+	l_timeout_remove(spool->sync_timeout);
+	spool->sync_timeout = NULL;
+
+	spool_sync(spool);
+}
+
+static void schedule_sync(struct spool *spool)
+{
+	if (spool->sync_timeout)
+		return;
+
+	spool->sync_timeout = l_timeout_create_ms(SPOOL_SYNC_INTERVAL_MS,
+						  on_sync_timeout, spool,
+						  NULL);
+}
+
+static int open_cursor(struct spool *spool)
+{
+	char path[PATH_MAX];
+	void *map;
+
+	snprintf(path, sizeof(path), "%s/%s", spool->path, SPOOL_CURSOR_FILE);
+
+	spool->cursor_fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+	if (spool->cursor_fd < 0)
+		return -errno;
+
+	if (ftruncate(spool->cursor_fd, sizeof(struct spool_cursor)) < 0)
+		return -errno;
+
+	map = mmap(NULL, sizeof(struct spool_cursor), PROT_READ | PROT_WRITE,
+		   MAP_SHARED, spool->cursor_fd, 0);
+	if (map == MAP_FAILED)
+		return -errno;
+
+	spool->cursor = map;
+
+	return 0;
+}
+
+static int scan_segments(struct spool *spool, uint32_t *first, uint32_t *last)
+{
+	struct dirent *entry;
+	char suffix[sizeof(SPOOL_SEGMENT_SUFFIX)];
+	unsigned int id;
+	bool found = false;
+	DIR *dir;
+
+	dir = opendir(spool->path);
+	if (!dir)
+		return -errno;
+
+	while ((entry = readdir(dir))) {
+		if (sscanf(entry->d_name, "%10u%4s", &id, suffix) != 2 ||
+		    strcmp(suffix, SPOOL_SEGMENT_SUFFIX))
+			continue;
+
+		if (!found || id < *first)
+			*first = id;
+		if (!found || id > *last)
+			*last = id;
+
+		found = true;
+	}
+
+	closedir(dir);
+
+	return found ? 0 : -ENOENT;
+}
+
+/* Finds where to append in the last segment, skipping a torn write */
+static uint32_t recover_write_offset(const struct spool_segment *segment)
+{
+	const struct spool_record *record;
+	uint32_t offset = 0;
+
+	while ((record = record_at(segment, offset)) &&
+	       record_is_intact(record))
+		offset += record->len;
+
+	return offset;
+}
+
+static int recover(struct spool *spool)
+{
+	struct spool_position *committed = &spool->cursor->committed;
+	uint32_t first = 0, last = 0, id;
+	bool outdated;
+	int err;
+
+	err = scan_segments(spool, &first, &last);
+	if (err < 0 && err != -ENOENT)
+		return err;
+
+	/* Records of another layout can't be read back, they are dropped */
+	outdated = !err && segment_is_outdated(spool, first);
+	if (outdated)
+		l_error("Spool %s holds records of another format, "
+			"discarding them", spool->path);
+
+	if (spool->cursor->magic != SPOOL_CURSOR_MAGIC) {
+		spool->cursor->magic = SPOOL_CURSOR_MAGIC;
+		committed->segment = err ? 1 : first;
+		committed->offset = 0;
+	}
+
+	if (err || outdated || last < committed->segment) {
+		/* Nothing left to publish, start over on a new segment */
+		for (id = first; !err && id <= last; id++)
+			segment_remove(spool, id);
+
+		committed->segment = err ? committed->segment : last + 1;
+		committed->offset = 0;
+
+		err = segment_map(spool, &spool->writer, committed->segment,
+				  true);
+		if (err < 0)
+			return err;
+
+		spool->write_pos = *committed;
+		spool->read_pos = *committed;
+		return 0;
+	}
+
+	for (id = first; id < committed->segment; id++)
+		segment_remove(spool, id);
+
+	err = segment_map(spool, &spool->writer, last, false);
+	if (err < 0)
+		return err;
+
+	spool->write_pos.segment = last;
+	spool->write_pos.offset = recover_write_offset(&spool->writer);
+
+	/*
+	 * The cursor may have reached the disk before the records it was
+	 * committed past, which are lost. Reading resumes where appending
+	 * does, or the reader would wait behind the writer forever.
+	 */
+	if (committed->segment == last &&
+	    committed->offset > spool->write_pos.offset) {
+		l_error("Spool %s truncated, cursor moved back by %u bytes",
+			spool->path,
+			committed->offset - spool->write_pos.offset);
+		*committed = spool->write_pos;
+		spool->cursor_dirty = true;
+	}
+
+	spool->read_pos = *committed;
+
+	return 0;
+}
+
+/**
+ * spool_open:
+ * @path: directory holding the spool files, created if missing
+ * @segment_size: size in bytes of each segment file
+ *
+ * Opens a spool, recovering the messages not confirmed before the previous
+ * process exited.
+ *
+ * Returns: the spool or NULL on failure.
+ */
+struct spool *spool_open(const char *path, size_t segment_size)
+{
+	struct spool *spool;
+	int err;
+
+	if (!path || segment_size < sizeof(struct spool_record))
+		return NULL;
+
+	if (mkdir(path, 0700) < 0 && errno != EEXIST) {
+		l_error("Failed to create spool %s: %s", path,
+			strerror(errno));
+		return NULL;
+	}
+
+	spool = l_new(struct spool, 1);
+	spool->path = l_strdup(path);
+	spool->segment_size = SPOOL_ALIGN(segment_size);
+	spool->writer.fd = -1;
+	spool->reader.fd = -1;
+	spool->cursor_fd = -1;
+	spool->inflight = l_queue_new();
+
+	err = open_cursor(spool);
+	if (err < 0)
+		goto fail;
+
+	err = recover(spool);
+	if (err < 0)
+		goto fail;
+
+	return spool;
+
+fail:
+	l_error("Failed to open spool %s: %s", path, strerror(-err));
+	spool_close(spool);
+	return NULL;
+}
+
+void spool_close(struct spool *spool)
+{
+	if (!spool)
+		return;
+
+	if (spool->writer.map)
+		spool_sync(spool);
+
+	l_timeout_remove(spool->sync_timeout);
+
+	segment_unmap(&spool->reader);
+	segment_unmap(&spool->writer);
+
+	if (spool->cursor)
+		munmap(spool->cursor, sizeof(*spool->cursor));
+	if (spool->cursor_fd >= 0)
+		close(spool->cursor_fd);
+
+	l_queue_destroy(spool->inflight, l_free);
+	l_free(spool->path);
+	l_free(spool);
+}
+
+/**
+ * spool_append:
+ * @spool: spool to write to
+ * @message: message to be appended
+ *
+ * Appends @message to the current segment, moving to a new segment once the
+ * current one is full. Data reaches the disk within one second.
+ *
+ * Returns: 0 if successful and a negative errno otherwise.
+ */
+int spool_append(struct spool *spool, const mq_message_data_t *message)
+{
+	const char *fields[SPOOL_FIELDS_LENGTH] = {
+		message->exchange,
+		message->routing_key,
+		message->body,
+		message->reply_to,
+		message->correlation_id,
+		message->content_type,
+		message->content_encoding
+	};
+	struct spool_record hdr;
+	uint8_t *dst;
+	size_t len;
+	int err;
+	int i;
+
+	len = sizeof(hdr);
+	for (i = 0; i < SPOOL_FIELDS_LENGTH; i++) {
+		if (i == SPOOL_FIELD_BODY)
+			hdr.field_len[i] = mq_message_body_len(message) + 1;
+		else if (fields[i])
+			hdr.field_len[i] = strlen(fields[i]) + 1;
+		else
+			hdr.field_len[i] = 0;
+		len += hdr.field_len[i];
+	}
+
+	if (SPOOL_ALIGN(len) > spool->segment_size)
+		return -EMSGSIZE;
+
+	if (spool->write_pos.offset + SPOOL_ALIGN(len) > spool->writer.size) {
+		spool_sync(spool);
+		segment_unmap(&spool->writer);
+
+		err = segment_map(spool, &spool->writer,
+				  spool->write_pos.segment + 1, true);
+		if (err < 0) {
+			l_error("Failed to create spool segment: %s",
+				strerror(-err));
+			return err;
+		}
+
+		spool->write_pos.segment++;
+		spool->write_pos.offset = 0;
+	}
+
+	dst = (uint8_t *) spool->writer.map + spool->write_pos.offset;
+
+	for (i = 0, len = sizeof(hdr); i < SPOOL_FIELDS_LENGTH; i++) {
+		if (!hdr.field_len[i])
+			continue;
+
+		/* A binary body may hold NUL bytes, copied by its length */
+		memcpy(dst + len, fields[i], hdr.field_len[i] - 1);
+		dst[len + hdr.field_len[i] - 1] = '\0';
+		len += hdr.field_len[i];
+	}
+
+	hdr.magic = SPOOL_RECORD_MAGIC;
+	hdr.len = SPOOL_ALIGN(len);
+	hdr.checksum = checksum(dst + sizeof(hdr), len - sizeof(hdr));
+	hdr.msg_type = message->msg_type;
+	hdr.priority = message->priority;
+	hdr.delivery_mode = message->delivery_mode;
+	hdr.expiration_ms = message->expiration_ms;
+	memcpy(dst, &hdr, sizeof(hdr));
+
+	if (spool->dirty_end <= spool->dirty_start)
+		spool->dirty_start = spool->write_pos.offset;
+	spool->write_pos.offset += hdr.len;
+	spool->dirty_end = spool->write_pos.offset;
+
+	schedule_sync(spool);
+
+	return 0;
+}
+
+/**
+ * spool_peek:
+ * @spool: spool to read from
+ * @message: filled with the next message to be replayed
+ * @seq: filled with the number to commit the message with
+ *
+ * The strings of @message point to the mapped segment, they remain valid
+ * until the next call on @spool.
+ *
+ * Returns: true if a message was read and false if there is none.
+ */
+bool spool_peek(struct spool *spool, mq_message_data_t *message,
+		unsigned int *seq)
+{
+	const char **fields[SPOOL_FIELDS_LENGTH] = {
+		&message->exchange,
+		&message->routing_key,
+		&message->body,
+		&message->reply_to,
+		&message->correlation_id,
+		&message->content_type,
+		&message->content_encoding
+	};
+	const struct spool_record *record = NULL;
+	struct spool_segment *segment;
+	const char *data;
+	int i;
+
+	while (!position_equal(&spool->read_pos, &spool->write_pos)) {
+		segment = reader_segment(spool, spool->read_pos.segment);
+		if (segment) {
+			record = record_at(segment, spool->read_pos.offset);
+			if (record)
+				break;
+		}
+
+		/* The end of a segment, move on to the next one */
+		if (spool->read_pos.segment >= spool->write_pos.segment)
+			return false;
+
+		spool->read_pos.segment++;
+		spool->read_pos.offset = 0;
+	}
+
+	if (!record)
+		return false;
+
+	message->msg_type = record->msg_type;
+	message->priority = record->priority;
+	message->delivery_mode = record->delivery_mode;
+	message->expiration_ms = record->expiration_ms;
+
+	data = (const char *) (record + 1);
+	for (i = 0; i < SPOOL_FIELDS_LENGTH; i++) {
+		*fields[i] = record->field_len[i] ? data : NULL;
+		data += record->field_len[i];
+	}
+
+	message->body_len = record->field_len[SPOOL_FIELD_BODY] - 1;
+
+	*seq = spool->next_seq;
+
+	return true;
+}
+
+/**
+ * spool_advance:
+ * @spool: spool being read
+ *
+ * Moves past the message returned by spool_peek() once it was published.
+ * It stays in the spool until committed with spool_commit().
+ */
+void spool_advance(struct spool *spool)
+{
+	const struct spool_record *record;
+	struct spool_segment *segment;
+	struct spool_inflight *inflight;
+
+	segment = reader_segment(spool, spool->read_pos.segment);
+	if (!segment)
+		return;
+
+	record = record_at(segment, spool->read_pos.offset);
+	if (!record)
+		return;
+
+	spool->read_pos.offset += record->len;
+
+	inflight = l_new(struct spool_inflight, 1);
+	inflight->seq = spool->next_seq++;
+	inflight->next = spool->read_pos;
+	l_queue_push_tail(spool->inflight, inflight);
+}
+
+static bool inflight_seq_cmp(const void *data, const void *user_data)
+{
+	const struct spool_inflight *inflight = data;
+
+	return inflight->seq == L_PTR_TO_UINT(user_data);
+}
+
+/**
+ * spool_commit:
+ * @spool: spool being read
+ * @seq: number of the message confirmed
+ *
+ * Marks a replayed message as confirmed. The cursor moves past every
+ * message confirmed in order and segments left behind are removed.
+ */
+void spool_commit(struct spool *spool, unsigned int seq)
+{
+	struct spool_position *committed = &spool->cursor->committed;
+	struct spool_inflight *inflight;
+	uint32_t id;
+
+	inflight = l_queue_find(spool->inflight, inflight_seq_cmp,
+				L_UINT_TO_PTR(seq));
+	if (!inflight)
+		return;
+
+	inflight->acked = true;
+
+	while ((inflight = l_queue_peek_head(spool->inflight)) &&
+	       inflight->acked) {
+		l_queue_pop_head(spool->inflight);
+
+		for (id = committed->segment; id < inflight->next.segment;
+		     id++)
+			segment_remove(spool, id);
+
+		*committed = inflight->next;
+		spool->cursor_dirty = true;
+		l_free(inflight);
+	}
+
+	schedule_sync(spool);
+}
+
+/**
+ * spool_rewind:
+ * @spool: spool being read
+ *
+ * Replays again every message not confirmed so far, after they were
+ * rejected or lost with the connection.
+ */
+void spool_rewind(struct spool *spool)
+{
+	l_queue_clear(spool->inflight, l_free);
+	spool->read_pos = spool->cursor->committed;
+}
+
+bool spool_is_empty(struct spool *spool)
+{
+	return !spool || position_equal(&spool->read_pos, &spool->write_pos);
+}
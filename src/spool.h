@@ -0,0 +1,36 @@
+/*
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2020, CESAR. All rights reserved.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+/**
+ * Persistent outbound message spool header file
+ */
+
+struct spool;
+
+struct spool *spool_open(const char *path, size_t segment_size);
+void spool_close(struct spool *spool);
+int spool_append(struct spool *spool, const mq_message_data_t *message);
+bool spool_peek(struct spool *spool, mq_message_data_t *message,
+		unsigned int *seq);
+void spool_advance(struct spool *spool);
+void spool_commit(struct spool *spool, unsigned int seq);
+void spool_rewind(struct spool *spool);
+bool spool_is_empty(struct spool *spool);
@@ -0,0 +1,250 @@
+/*
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2020, CESAR. All rights reserved.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+/**
+ * Thread-safe data submission source file
+ *
+ * Any thread pushes samples into a bounded lock-free ring with multiple
+ * producers and a single consumer. The consumer runs on the main loop,
+ * woken up through an eventfd, and hands each sample to the SDK.
+ *
+ * Each slot carries a sequence number: a producer claims a position by
+ * advancing the enqueue position and then releases the slot by setting
+ * its sequence, so the consumer never sees a slot still being written.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <errno.h>
+#include <limits.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <ell/ell.h>
+
+#include <knot/knot_protocol.h>
+
+#include "knot_cloud.h"
+#include "submit.h"
+
+struct submit_slot {
+	unsigned int seq;
+	char id[SUBMIT_ID_LEN];
+	struct knot_cloud_sample sample;
+};
+
+struct submit_context {
+	struct submit_slot *slots;
+	unsigned int mask;
+	unsigned int enqueue_pos;
+	unsigned int dequeue_pos;
+	bool wakeup_pending;
+	int efd;
+	struct l_io *io;
+	submit_cb_t submit_cb;
+};
+
+static struct submit_context submit_ctx = {
+	.efd = -1
+};
+
+static void submit_drain(void)
+{
+	struct submit_slot *slot;
+	unsigned int pos = submit_ctx.dequeue_pos;
+
+	for (;;) {
+		slot = &submit_ctx.slots[pos & submit_ctx.mask];
+
+		/* Empty, or the producer hasn't released the slot yet */
+		if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != pos + 1)
+			break;
+
+		submit_ctx.submit_cb(slot->id, &slot->sample);
+
+		/* Hand the slot back to producers for the next lap */
+		__atomic_store_n(&slot->seq, pos + submit_ctx.mask + 1,
+				 __ATOMIC_RELEASE);
+		pos++;
+	}
+
+	submit_ctx.dequeue_pos = pos;
+}
+
+static bool on_wakeup(struct l_io *io, void *user_data)
+{
+	uint64_t count;
+
+	if (read(submit_ctx.efd, &count, sizeof(count)) < 0 &&
+	    errno != EAGAIN)
+		l_error("Failed to read submit eventfd");
+
+	/*
+	 * Clear the flag before draining, so a sample released after the
+	 * drain passed it writes to the eventfd again.
+	 */
+	__atomic_store_n(&submit_ctx.wakeup_pending, false, __ATOMIC_SEQ_CST);
+
+	submit_drain();
+
+	return true;
+}
+
+/**
+ * submit_push:
+ * @id: device id
+ * @sample: sensor reading to be published
+ *
+ * Queues @sample to be published from the main loop. Safe to call from any
+ * thread, it never takes a lock nor blocks.
+ *
+ * Returns: 0 if successful, -EAGAIN if the queue is full or a negative
+ * errno otherwise.
+ */
+int submit_push(const char *id, const struct knot_cloud_sample *sample)
+{
+	struct submit_slot *slot;
+	unsigned int pos, seq;
+	uint64_t count = 1;
+	size_t len;
+	int diff;
+
+	if (!submit_ctx.slots)
+		return -ENOTCONN;
+
+	len = strlen(id);
+	if (len >= SUBMIT_ID_LEN)
+		return -EINVAL;
+
+	pos = __atomic_load_n(&submit_ctx.enqueue_pos, __ATOMIC_RELAXED);
+	for (;;) {
+		slot = &submit_ctx.slots[pos & submit_ctx.mask];
+		seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		diff = (int) (seq - pos);
+
+		if (diff < 0)
+			return -EAGAIN;
+
+		/* On failure pos is updated with the current position */
+		if (!diff && __atomic_compare_exchange_n(
+					&submit_ctx.enqueue_pos, &pos, pos + 1,
+					true, __ATOMIC_RELAXED,
+					__ATOMIC_RELAXED))
+			break;
+
+		if (diff)
+			pos = __atomic_load_n(&submit_ctx.enqueue_pos,
+					      __ATOMIC_RELAXED);
+	}
+
+	memcpy(slot->id, id, len + 1);
+	slot->sample = *sample;
+	__atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+
+	/*
+	 * Only the first producer since the last drain wakes the loop. The
+	 * sample is queued already, so a failed wakeup isn't reported: the
+	 * next producer tries again and the next drain sends it anyway.
+	 */
+	if (!__atomic_exchange_n(&submit_ctx.wakeup_pending, true,
+				 __ATOMIC_SEQ_CST) &&
+	    write(submit_ctx.efd, &count, sizeof(count)) < 0)
+		__atomic_store_n(&submit_ctx.wakeup_pending, false,
+				 __ATOMIC_SEQ_CST);
+
+	return 0;
+}
+
+/**
+ * submit_start:
+ * @capacity: number of samples the queue holds, rounded up to a power of 2
+ * @submit_cb: callback called on the main loop with each sample
+ *
+ * Sets up the queue. Must be called from the main loop thread before any
+ * producer pushes a sample.
+ *
+ * Returns: 0 if successful and a negative errno otherwise.
+ */
+int submit_start(size_t capacity, submit_cb_t submit_cb)
+{
+	unsigned int size = 1;
+	unsigned int i;
+
+	if (!capacity || capacity > UINT_MAX / 2 || !submit_cb)
+		return -EINVAL;
+
+	if (submit_ctx.slots)
+		return -EALREADY;
+
+	while (size < capacity)
+		size <<= 1;
+
+	submit_ctx.efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (submit_ctx.efd < 0)
+		return -errno;
+
+	submit_ctx.io = l_io_new(submit_ctx.efd);
+	if (!submit_ctx.io) {
+		close(submit_ctx.efd);
+		submit_ctx.efd = -1;
+		return -ENOMEM;
+	}
+
+	l_io_set_close_on_destroy(submit_ctx.io, true);
+	l_io_set_read_handler(submit_ctx.io, on_wakeup, NULL, NULL);
+
+	submit_ctx.slots = l_new(struct submit_slot, size);
+	for (i = 0; i < size; i++)
+		submit_ctx.slots[i].seq = i;
+
+	submit_ctx.mask = size - 1;
+	submit_ctx.enqueue_pos = 0;
+	submit_ctx.dequeue_pos = 0;
+	submit_ctx.wakeup_pending = false;
+	submit_ctx.submit_cb = submit_cb;
+
+	return 0;
+}
+
+/**
+ * submit_stop:
+ *
+ * Publishes the samples still queued and releases the queue. Producers
+ * must not push samples anymore.
+ */
+void submit_stop(void)
+{
+	if (!submit_ctx.slots)
+		return;
+
+	submit_drain();
+
+	l_io_destroy(submit_ctx.io);
+	submit_ctx.io = NULL;
+	submit_ctx.efd = -1;
+
+	l_free(submit_ctx.slots);
+	submit_ctx.slots = NULL;
+}
@@ -0,0 +1,35 @@
+/*
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2020, CESAR. All rights reserved.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+/**
+ * Thread-safe data submission header file
+ */
+
+#define SUBMIT_ID_LEN 64
+
+struct knot_cloud_sample;
+
+typedef void (*submit_cb_t) (const char *id,
+			     const struct knot_cloud_sample *sample);
+
+int submit_push(const char *id, const struct knot_cloud_sample *sample);
+int submit_start(size_t capacity, submit_cb_t submit_cb);
+void submit_stop(void);